@@ -0,0 +1,442 @@
+#ifndef KAFKA_EXAMPLE_CHUNKING_H
+#define KAFKA_EXAMPLE_CHUNKING_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "show_result.h"
+#include "topic_manager.h"
+
+/**
+ * 超过broker单条消息大小限制的value可以拆分为多个chunk记录生产，消费时再重组。
+ *
+ * 同一条消息的所有chunk使用相同的key(即消息id)，并通过chunk_partitioner按key选择
+ * partition，从而保证它们位于同一个partition中。每个chunk携带以下headers:
+ *     x-chunk-id     消息id
+ *     x-chunk-seq    chunk序号，从0开始
+ *     x-chunk-count  chunk总数
+ *     x-chunk-total  消息总长度
+ *     x-chunk-pos    该chunk在消息中的起始位置
+ *
+ * 重组时根据x-chunk-total一次性分配缓冲区，每个chunk直接拷贝到最终位置，不经过
+ * 中间拼接。chunk headers在分配和拷贝前都会被校验，与长度不一致或与同一消息之前的
+ * chunk矛盾的记录会被丢弃。
+ *
+ * 所有未完成消息占用的内存由max_bytes限制。没有空间为新消息分配缓冲区时，该partition
+ * 上从这条记录开始的记录都暂不处理，由调用者稍后重新交给feed或重新拉取，已分配的
+ * 缓冲区不会被释放。未完成消息超过timeout没有收到新的chunk时，认为它永远不会完整
+ * (例如生产者在发送过程中崩溃，或它剩余的chunk位于暂不处理的记录之后)，记录日志后
+ * 放弃，释放缓冲区并不再阻止提交。没有对应未完成消息的非首个chunk(所属消息已被放弃
+ * 或起始位置早于开始消费的位置)直接丢弃。
+*/
+
+namespace chunking_detail {
+
+inline uint64_t hash_bytes(const void *data, std::size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t h = 14695981039346656037ull;
+
+    for (std::size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+
+    return h;
+}
+
+inline std::string next_message_id() {
+    static const uint64_t seed = std::random_device{}() ^
+        (uint64_t)std::chrono::system_clock::now().time_since_epoch().count();
+    static std::atomic<uint64_t> counter{0};
+
+    return std::format("{:016x}-{}", seed, counter.fetch_add(1));
+}
+
+// 最多18位，不会超出long long的范围
+inline bool parse_number(const void *data, std::size_t len, long long &value) {
+    const char *p = (const char *)data;
+
+    if (len == 0 || len > 18)
+        return false;
+
+    value = 0;
+    for (std::size_t i = 0; i < len; i++) {
+        if (p[i] < '0' || p[i] > '9')
+            return false;
+        value = value * 10 + (p[i] - '0');
+    }
+
+    return true;
+}
+
+} // namespace chunking_detail
+
+// 按key选择partition，没有key的记录随机选择
+inline int chunk_partitioner(const char *topic, const void *key, std::size_t key_len,
+                             int partition_num)
+{
+    if (partition_num <= 0)
+        return 0;
+
+    if (key_len == 0)
+        return (int)(std::random_device{}() % partition_num);
+
+    return (int)(chunking_detail::hash_bytes(key, key_len) % partition_num);
+}
+
+/**
+ * 向生产任务中添加一条value，长度超过chunk_size时拆分为多个chunk记录。任务需要通过
+ * set_partitioner设置chunk_partitioner。返回添加的记录数。
+*/
+inline std::size_t add_chunked_value(WFKafkaTask *task, const std::string &topic,
+                                     const void *value, std::size_t len,
+                                     std::size_t chunk_size)
+{
+    const char *p = (const char *)value;
+
+    if (chunk_size == 0 || len <= chunk_size) {
+        protocol::KafkaRecord r;
+        r.set_value(value, len);
+        task->add_produce_record(topic, -1, std::move(r));
+        return 1;
+    }
+
+    std::string id = chunking_detail::next_message_id();
+    std::size_t count = (len + chunk_size - 1) / chunk_size;
+
+    for (std::size_t seq = 0; seq < count; seq++) {
+        std::size_t pos = seq * chunk_size;
+        std::size_t n = std::min(chunk_size, len - pos);
+        protocol::KafkaRecord r;
+
+        r.set_key(id.data(), id.size());
+        r.set_value(p + pos, n);
+        r.add_header_pair("x-chunk-id", id);
+        r.add_header_pair("x-chunk-seq", std::to_string(seq));
+        r.add_header_pair("x-chunk-count", std::to_string(count));
+        r.add_header_pair("x-chunk-total", std::to_string(len));
+        r.add_header_pair("x-chunk-pos", std::to_string(pos));
+
+        task->add_produce_record(topic, -1, std::move(r));
+    }
+
+    return count;
+}
+
+struct ChunkedMessage {
+    const char *topic;
+    int partition;
+    const std::string &id;
+    long long first_offset;
+    long long last_offset;
+    const char *data;
+    std::size_t size;
+};
+
+// 取出vec_records中每个partition位于pos之前的记录
+inline void records_before(const vec_records_t &vec_records,
+                           const std::vector<std::size_t> &pos, vec_records_t &out)
+{
+    out.clear();
+    out.resize(vec_records.size());
+
+    for (std::size_t i = 0; i < vec_records.size(); i++) {
+        auto first = vec_records[i].begin();
+        out[i].assign(first, first + std::min(pos[i], vec_records[i].size()));
+    }
+}
+
+class ChunkReassembler {
+public:
+    using clock_type = std::chrono::steady_clock;
+
+    ChunkReassembler(std::size_t max_bytes, clock_type::duration timeout)
+        : max_bytes(max_bytes), timeout(timeout)
+    { }
+
+    /**
+     * 处理一批拉取到的记录中第i个partition从pos[i]开始的部分，pos为空时从头开始，
+     * 返回时pos[i]为处理到的位置。不含chunk headers的普通记录按原有结构放入plain，
+     * 重组完成的消息依次传给func(const ChunkedMessage &)，data在func返回后释放。
+     *
+     * 缓冲区已满时对应partition停在需要分配缓冲区的chunk处，此时返回false，调用者
+     * 可以稍后用同样的pos再次调用，或从该记录的offset重新拉取。
+    */
+    template<typename Func>
+    bool feed(const vec_records_t &vec_records, std::vector<std::size_t> &pos,
+              vec_records_t &plain, Func &&func)
+    {
+        bool done = true;
+
+        expire();
+
+        plain.clear();
+        plain.resize(vec_records.size());
+        pos.resize(vec_records.size(), 0);
+
+        for (std::size_t i = 0; i < vec_records.size(); i++) {
+            const auto &records = vec_records[i];
+
+            for (; pos[i] < records.size(); pos[i]++) {
+                protocol::KafkaRecord *rec = records[pos[i]];
+                ChunkInfo info;
+
+                if (!parse_chunk(*rec, info))
+                    plain[i].push_back(rec);
+                else if (!feed_chunk(*rec, info, func)) {
+                    done = false;
+                    break;
+                }
+            }
+        }
+
+        return done;
+    }
+
+    // 返回该partition上最早的未完成消息的起始offset，没有时返回-1
+    long long first_pending_offset(const std::string &topic, int partition) const {
+        long long first = -1;
+
+        for (const auto &[key, msg] : pending) {
+            if (key.toppar.partition == partition && key.toppar.topic == topic) {
+                if (first < 0 || msg.first_offset < first)
+                    first = msg.first_offset;
+            }
+        }
+
+        return first;
+    }
+
+    /**
+     * 返回records中可以提交的最后一条记录，即位于所有未完成消息之前的最后一条记录；
+     * 若本批次中没有可提交的记录则返回nullptr，此时之前提交的offset仍然有效。
+    */
+    protocol::KafkaRecord *
+    last_committable(const std::vector<protocol::KafkaRecord *> &records) const {
+        if (records.empty())
+            return nullptr;
+
+        protocol::KafkaRecord *back = records.back();
+        long long first = first_pending_offset(back->get_topic(), back->get_partition());
+        if (first < 0)
+            return back;
+
+        for (auto it = records.rbegin(); it != records.rend(); ++it) {
+            if ((*it)->get_offset() < first)
+                return *it;
+        }
+
+        return nullptr;
+    }
+
+private:
+    struct ChunkInfo {
+        std::string id;
+        long long seq;
+        long long count;
+        long long total;
+        long long pos;
+    };
+
+    struct MessageKey {
+        TopicManager::TopparKey toppar;
+        std::string id;
+
+        bool operator< (const MessageKey &other) const {
+            if (toppar < other.toppar)
+                return true;
+            if (other.toppar < toppar)
+                return false;
+            return id < other.id;
+        }
+    };
+
+    struct PendingMessage {
+        std::unique_ptr<char[]> buf;
+        std::size_t total;
+        std::vector<bool> received;
+        long long remain;
+        long long first_offset;
+        long long last_offset;
+        clock_type::time_point last_update;
+    };
+
+    static bool parse_chunk(const protocol::KafkaRecord &rec, ChunkInfo &info) {
+        protocol::KafkaHeaderCursor cursor(rec.get_header_list());
+        const void *key, *value;
+        std::size_t key_len, value_len;
+        int found = 0;
+
+        while (cursor.next(&key, &key_len, &value, &value_len)) {
+            std::string_view k((const char *)key, key_len);
+            bool ok = true;
+
+            if (k == "x-chunk-id")
+                info.id.assign((const char *)value, value_len);
+            else if (k == "x-chunk-seq")
+                ok = chunking_detail::parse_number(value, value_len, info.seq);
+            else if (k == "x-chunk-count")
+                ok = chunking_detail::parse_number(value, value_len, info.count);
+            else if (k == "x-chunk-total")
+                ok = chunking_detail::parse_number(value, value_len, info.total);
+            else if (k == "x-chunk-pos")
+                ok = chunking_detail::parse_number(value, value_len, info.pos);
+            else
+                continue;
+
+            if (!ok)
+                return false;
+
+            ++found;
+        }
+
+        return found == 5;
+    }
+
+    /**
+     * 检查chunk的headers与它自身的长度是否一致：除最后一个chunk外，所有chunk的长度
+     * 都等于拆分时的chunk_size，因此count必须等于total按chunk_size向上取整，pos必须
+     * 等于seq * chunk_size；最后一个chunk必须恰好结束于total。
+    */
+    static bool check_chunk(const ChunkInfo &info, std::size_t value_len) {
+        long long len = (long long)value_len;
+
+        if (info.count <= 0 || info.seq >= info.count || info.count > info.total || len <= 0)
+            return false;
+
+        if (info.seq + 1 < info.count) {
+            return info.pos == info.seq * len &&
+                   info.count == (info.total + len - 1) / len;
+        }
+
+        if (info.pos + len != info.total)
+            return false;
+
+        if (info.seq == 0)
+            return info.pos == 0;
+
+        long long chunk = info.pos / info.seq;
+        return info.pos % info.seq == 0 && len <= chunk &&
+               info.count == (info.total + chunk - 1) / chunk;
+    }
+
+    // 只有缓冲区已满、无法为新消息分配时返回false，被丢弃的chunk同样视为已处理
+    template<typename Func>
+    bool feed_chunk(const protocol::KafkaRecord &rec, const ChunkInfo &info, Func &func) {
+        const void *value;
+        std::size_t value_len;
+        rec.get_value(&value, &value_len);
+
+        if ((std::size_t)info.total > max_bytes || !check_chunk(info, value_len)) {
+            std::cout << std::format("Drop chunk id:{} seq:{}", info.id, info.seq) << std::endl;
+            return true;
+        }
+
+        MessageKey key{{rec.get_topic(), rec.get_partition()}, info.id};
+        auto it = pending.find(key);
+
+        if (it == pending.end()) {
+            if (info.seq != 0) {
+                std::cout << std::format("Drop orphan chunk id:{} seq:{}", info.id, info.seq)
+                          << std::endl;
+                return true;
+            }
+
+            if (used_bytes + info.total > max_bytes)
+                return false;
+
+            PendingMessage msg;
+            msg.buf.reset(new char[info.total]);
+            msg.total = info.total;
+            msg.received.assign(info.count, false);
+            msg.remain = info.count;
+            msg.first_offset = rec.get_offset();
+            msg.last_offset = rec.get_offset();
+
+            used_bytes += msg.total;
+            it = pending.emplace(std::move(key), std::move(msg)).first;
+        }
+
+        PendingMessage &msg = it->second;
+
+        // 与同一消息之前的chunk矛盾的记录不能写入按之前的total分配的缓冲区
+        if ((std::size_t)info.total != msg.total ||
+            (std::size_t)info.count != msg.received.size() ||
+            (std::size_t)info.pos + value_len > msg.total)
+        {
+            std::cout << std::format("Drop inconsistent chunk id:{} seq:{}", info.id, info.seq)
+                      << std::endl;
+            return true;
+        }
+
+        // 重复拉取到的chunk直接忽略
+        if (msg.received[info.seq])
+            return true;
+
+        std::memcpy(msg.buf.get() + info.pos, value, value_len);
+        msg.received[info.seq] = true;
+        msg.last_offset = rec.get_offset();
+        msg.last_update = clock_type::now();
+
+        if (--msg.remain > 0)
+            return true;
+
+        ChunkedMessage done{
+            rec.get_topic(), rec.get_partition(), it->first.id,
+            msg.first_offset, msg.last_offset, msg.buf.get(), msg.total,
+        };
+
+        func(done);
+
+        used_bytes -= msg.total;
+        pending.erase(it);
+        return true;
+    }
+
+    // 放弃超过timeout没有收到新chunk的未完成消息
+    void expire() {
+        auto now = clock_type::now();
+
+        for (auto it = pending.begin(); it != pending.end(); ) {
+            const PendingMessage &msg = it->second;
+
+            if (now - msg.last_update <= timeout) {
+                ++it;
+                continue;
+            }
+
+            auto received = std::count(msg.received.begin(), msg.received.end(), true);
+            std::cout << std::format("Abandon incomplete message id:{} first_offset:{} "
+                                     "received:{}/{}", it->first.id, msg.first_offset,
+                                     received, msg.received.size()) << std::endl;
+
+            used_bytes -= msg.total;
+            it = pending.erase(it);
+        }
+    }
+
+private:
+    std::size_t max_bytes;
+    clock_type::duration timeout;
+    std::size_t used_bytes{0};
+    std::map<MessageKey, PendingMessage> pending;
+};
+
+inline void show_chunked_message(const ChunkedMessage &msg) {
+    auto str = std::format("topic:{} partition:{} offset:{}-{} id:{} vlen:{}\n",
+                           msg.topic, msg.partition, msg.first_offset, msg.last_offset,
+                           msg.id, msg.size);
+    std::cout << str;
+}
+
+#endif // KAFKA_EXAMPLE_CHUNKING_H
@@ -0,0 +1,49 @@
+#ifndef KAFKA_EXAMPLE_GLOBAL_SETTINGS_H
+#define KAFKA_EXAMPLE_GLOBAL_SETTINGS_H
+
+#include "coke/tools/option_parser.h"
+#include "workflow/WFGlobal.h"
+
+/**
+ * workflow的线程数在第一次使用前由WFGlobalSettings确定，之后无法修改。默认设置下
+ * poller线程只有4个，handler线程为20个，在核数较多的机器上会先于网络和broker成为瓶颈。
+ * 各示例通过下面两个函数提供统一的命令行选项，小于等于0的值表示使用workflow的默认值。
+*/
+
+struct ThreadSettings {
+    int poller_threads{0};
+    int handler_threads{0};
+    int compute_threads{0};
+};
+
+inline void add_thread_options(coke::OptionParser &args, ThreadSettings &ts) {
+    args.add_integer(ts.poller_threads, 0, "poller-threads", false)
+        .set_default(0)
+        .set_description("Number of workflow poller threads, default 4.");
+
+    args.add_integer(ts.handler_threads, 0, "handler-threads", false)
+        .set_default(0)
+        .set_description("Number of workflow handler threads, default 20.");
+
+    args.add_integer(ts.compute_threads, 0, "compute-threads", false)
+        .set_default(0)
+        .set_description("Number of workflow compute threads, default the number of cpus.");
+}
+
+// 必须在创建任何workflow任务(包括WFKafkaClient::init)之前调用
+inline void apply_thread_settings(const ThreadSettings &ts) {
+    WFGlobalSettings settings = GLOBAL_SETTINGS_DEFAULT;
+
+    if (ts.poller_threads > 0)
+        settings.poller_threads = ts.poller_threads;
+
+    if (ts.handler_threads > 0)
+        settings.handler_threads = ts.handler_threads;
+
+    if (ts.compute_threads > 0)
+        settings.compute_threads = ts.compute_threads;
+
+    WORKFLOW_library_init(&settings);
+}
+
+#endif // KAFKA_EXAMPLE_GLOBAL_SETTINGS_H
@@ -0,0 +1,128 @@
+#ifndef KAFKA_EXAMPLE_LATENCY_HISTOGRAM_H
+#define KAFKA_EXAMPLE_LATENCY_HISTOGRAM_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/**
+ * HdrHistogram风格的延迟直方图，在[1, max_value]范围内以固定的有效数字位数记录数值。
+ * 桶按2的幂划分，每个桶内再均分为sub_bucket_count份，因此相对误差不超过
+ * 10^(-significant_digits)，占用内存与记录次数无关。
+ *
+ * 该类不是线程安全的，并发记录时需要由调用者加锁，或每个线程使用独立的对象后merge。
+*/
+
+class LatencyHistogram {
+public:
+    LatencyHistogram(int64_t max_value = 60LL * 1000 * 1000, int significant_digits = 3) {
+        int64_t largest = 2 * (int64_t)std::pow(10, significant_digits);
+        int mag = (int)std::ceil(std::log2((double)largest));
+
+        sub_bucket_half_mag = mag - 1;
+        sub_bucket_count = 1LL << mag;
+        sub_bucket_half = sub_bucket_count / 2;
+        sub_bucket_mask = sub_bucket_count - 1;
+
+        int64_t smallest_untrackable = sub_bucket_count;
+        bucket_count = 1;
+        while (smallest_untrackable <= max_value) {
+            smallest_untrackable <<= 1;
+            ++bucket_count;
+        }
+
+        this->max_value = max_value;
+        counts.assign((bucket_count + 1) * sub_bucket_half, 0);
+    }
+
+    void record(int64_t value, int64_t count = 1) {
+        value = std::clamp<int64_t>(value, 1, max_value);
+        counts[index_of(value)] += count;
+
+        total += count;
+        sum += (double)value * count;
+        min_seen = std::min(min_seen, value);
+        max_seen = std::max(max_seen, value);
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for (std::size_t i = 0; i < counts.size() && i < other.counts.size(); i++)
+            counts[i] += other.counts[i];
+
+        total += other.total;
+        sum += other.sum;
+        min_seen = std::min(min_seen, other.min_seen);
+        max_seen = std::max(max_seen, other.max_seen);
+    }
+
+    void reset() {
+        std::fill(counts.begin(), counts.end(), 0);
+        total = 0;
+        sum = 0;
+        min_seen = INT64_MAX;
+        max_seen = 0;
+    }
+
+    // 返回不小于percentile%的记录的最小值，percentile取值为[0, 100]
+    int64_t percentile(double percentile) const {
+        if (total == 0)
+            return 0;
+
+        double p = std::clamp(percentile, 0.0, 100.0);
+        int64_t target = std::max<int64_t>(1, (int64_t)std::ceil(p / 100.0 * total));
+        int64_t acc = 0;
+
+        for (std::size_t i = 0; i < counts.size(); i++) {
+            acc += counts[i];
+            if (acc >= target)
+                return std::min(highest_equivalent(i), max_seen);
+        }
+
+        return max_seen;
+    }
+
+    int64_t count() const { return total; }
+    int64_t min() const { return total ? min_seen : 0; }
+    int64_t max() const { return max_seen; }
+    double mean() const { return total ? sum / total : 0; }
+
+private:
+    std::size_t index_of(int64_t value) const {
+        int pow2ceiling = 64 - __builtin_clzll((uint64_t)(value | sub_bucket_mask));
+        int bucket_index = pow2ceiling - sub_bucket_half_mag - 1;
+        int64_t sub_bucket_index = value >> bucket_index;
+
+        return ((std::size_t)(bucket_index + 1) << sub_bucket_half_mag) +
+               sub_bucket_index - sub_bucket_half;
+    }
+
+    // 与下标i对应的桶中可以表示的最大值
+    int64_t highest_equivalent(std::size_t i) const {
+        int bucket_index = (int)(i >> sub_bucket_half_mag) - 1;
+        int64_t sub_bucket_index = (int64_t)(i & (sub_bucket_half - 1)) + sub_bucket_half;
+
+        if (bucket_index < 0) {
+            sub_bucket_index -= sub_bucket_half;
+            bucket_index = 0;
+        }
+
+        return ((sub_bucket_index + 1) << bucket_index) - 1;
+    }
+
+private:
+    int sub_bucket_half_mag;
+    int64_t sub_bucket_count;
+    int64_t sub_bucket_half;
+    int64_t sub_bucket_mask;
+    int bucket_count;
+    int64_t max_value;
+
+    std::vector<int64_t> counts;
+    int64_t total{0};
+    double sum{0};
+    int64_t min_seen{INT64_MAX};
+    int64_t max_seen{0};
+};
+
+#endif // KAFKA_EXAMPLE_LATENCY_HISTOGRAM_H
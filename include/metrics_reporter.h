@@ -0,0 +1,108 @@
+#ifndef KAFKA_EXAMPLE_METRICS_REPORTER_H
+#define KAFKA_EXAMPLE_METRICS_REPORTER_H
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <iostream>
+
+#include "retry_policy.h"
+
+#include "coke/wait.h"
+#include "coke/stop_token.h"
+#include "coke/tools/option_parser.h"
+
+/**
+ * 运行期间定期将各RetryPolicy的指标以Prometheus文本格式写入指定文件，可以直接交给
+ * node_exporter的textfile collector采集。文件先写入临时文件再rename，采集方不会读到
+ * 写了一半的内容。未指定文件时不做任何事。
+*/
+
+struct MetricsSettings {
+    std::string file;
+    int interval{10};
+};
+
+inline void add_metrics_options(coke::OptionParser &args, MetricsSettings &ms) {
+    args.add_string(ms.file, 0, "metrics-file", false)
+        .set_description("Periodically write retry and breaker metrics to this file.");
+
+    args.add_integer(ms.interval, 0, "metrics-interval", false)
+        .set_default(10)
+        .set_description("Seconds between two writes of --metrics-file.");
+}
+
+class MetricsReporter {
+public:
+    MetricsReporter(const MetricsSettings &ms) : ms(ms) { }
+
+    MetricsReporter(const MetricsReporter &) = delete;
+    MetricsReporter &operator= (const MetricsReporter &) = delete;
+
+    // 被添加的对象必须在stop返回之后才能销毁
+    void add(const RetryPolicy *policy) {
+        policies.push_back(policy);
+    }
+
+    void start() {
+        if (ms.file.empty() || started)
+            return;
+
+        started = true;
+        coke::detach(run());
+    }
+
+    // 停止定期写入，并在返回前写入最后一次的指标
+    void stop() {
+        if (!started)
+            return;
+
+        tk.request_stop();
+        coke::sync_wait(tk.wait_finish());
+        started = false;
+    }
+
+private:
+    coke::Task<> run() {
+        coke::StopToken::FinishGuard fg(&tk);
+        auto interval = std::chrono::seconds(std::max(ms.interval, 1));
+
+        while (!tk.stop_requested()) {
+            dump();
+            co_await tk.wait_stop_for(interval);
+        }
+
+        dump();
+    }
+
+    void dump() {
+        std::string tmp = ms.file + ".tmp";
+        std::error_code ec;
+
+        {
+            std::ofstream ofs(tmp, std::ios::trunc);
+            for (const RetryPolicy *policy : policies)
+                ofs << policy->metrics();
+
+            if (!ofs.good()) {
+                std::cout << "Write metrics file " << tmp << " failed" << std::endl;
+                return;
+            }
+        }
+
+        std::filesystem::rename(tmp, ms.file, ec);
+        if (ec)
+            std::cout << "Rename metrics file " << ms.file << " failed" << std::endl;
+    }
+
+private:
+    MetricsSettings ms;
+    std::vector<const RetryPolicy *> policies;
+    coke::StopToken tk;
+    bool started{false};
+};
+
+#endif // KAFKA_EXAMPLE_METRICS_REPORTER_H
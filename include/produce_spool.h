@@ -0,0 +1,416 @@
+#ifndef KAFKA_EXAMPLE_PRODUCE_SPOOL_H
+#define KAFKA_EXAMPLE_PRODUCE_SPOOL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * 生产失败时使用的本地预写缓冲区。数据以追加方式写入若干个固定大小、通过mmap映射的
+ * 段文件中，消费位置记录在单独的head文件里，因此进程重启后可以继续回放未成功生产的
+ * 数据。总磁盘占用由max_bytes限制，超出时append返回false，调用者应当暂停写入，
+ * 等待回放释放空间后再重试。max_bytes至少需要容纳两个段。
+ *
+ * 已存在的段按其在磁盘上的实际大小映射，因此重启时修改segment_size不会截断已有数据，
+ * 新的段才使用新的大小。
+ *
+ * 段文件中每条记录的格式为 | magic | key_len | value_len | checksum | key | value |，
+ * 重启扫描时遇到magic或checksum不匹配的位置即认为是该段的写入末尾。
+ *
+ * 该类不是线程安全的，示例中只在一个协程里使用。
+*/
+
+class ProduceSpool {
+public:
+    struct Position {
+        uint64_t seq;
+        uint64_t pos;
+    };
+
+    ProduceSpool() = default;
+    ~ProduceSpool() { close(); }
+
+    ProduceSpool(const ProduceSpool &) = delete;
+    ProduceSpool &operator= (const ProduceSpool &) = delete;
+
+    bool open(const std::string &dir, std::size_t segment_size, std::size_t max_bytes) {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        std::vector<uint64_t> seqs;
+
+        fs::create_directories(dir, ec);
+        if (ec)
+            return false;
+
+        if (segment_size <= HEADER_SIZE || max_bytes / 2 < segment_size)
+            return false;
+
+        this->dir = dir;
+        this->segment_size = segment_size;
+        this->max_bytes = max_bytes;
+
+        for (const auto &entry : fs::directory_iterator(dir, ec)) {
+            const fs::path &p = entry.path();
+            if (p.extension() != ".seg")
+                continue;
+
+            try {
+                seqs.push_back(std::stoull(p.stem().string()));
+            }
+            catch (...) {
+                continue;
+            }
+        }
+
+        if (ec)
+            return false;
+
+        std::sort(seqs.begin(), seqs.end());
+        load_head();
+
+        for (uint64_t seq : seqs) {
+            // 已经全部回放完成的段，可能是上次删除前进程退出了
+            if (seq < head.seq) {
+                fs::remove(segment_path(seq), ec);
+                continue;
+            }
+
+            Segment seg;
+            if (!map_segment(seq, false, seg)) {
+                close();
+                return false;
+            }
+
+            seg.write_pos = scan_segment(seg);
+            segments.push_back(seg);
+        }
+
+        if (segments.empty())
+            next_seq = head.seq;
+        else {
+            next_seq = segments.back().seq + 1;
+            if (head.seq < segments.front().seq)
+                head = Position{segments.front().seq, 0};
+        }
+
+        return true;
+    }
+
+    void close() {
+        for (Segment &seg : segments)
+            unmap_segment(seg);
+
+        segments.clear();
+    }
+
+    bool append(const void *key, std::size_t key_len,
+                const void *value, std::size_t value_len)
+    {
+        std::size_t rec_len = HEADER_SIZE + key_len + value_len;
+        if (rec_len > segment_size)
+            return false;
+
+        if (segments.empty() || segments.back().write_pos + rec_len > segments.back().size) {
+            if (disk_bytes() + segment_size > max_bytes)
+                return false;
+
+            Segment seg;
+            if (!map_segment(next_seq, true, seg))
+                return false;
+
+            segments.push_back(seg);
+            ++next_seq;
+        }
+
+        Segment &seg = segments.back();
+        char *p = seg.base + seg.write_pos;
+        uint32_t hdr[4] = {
+            MAGIC,
+            (uint32_t)key_len,
+            (uint32_t)value_len,
+            checksum(key, key_len, value, value_len),
+        };
+
+        // 先写数据再写头部，头部写入后这条记录才对扫描可见
+        if (key_len)
+            std::memcpy(p + HEADER_SIZE, key, key_len);
+        if (value_len)
+            std::memcpy(p + HEADER_SIZE + key_len, value, value_len);
+        std::memcpy(p, hdr, HEADER_SIZE);
+
+        seg.write_pos += rec_len;
+        return true;
+    }
+
+    /**
+     * 将已写入的数据刷到磁盘。mmap写入的数据在进程崩溃后仍保留在page cache中，
+     * 只有需要抵御机器掉电时才必须调用。
+    */
+    bool sync() {
+        for (Segment &seg : segments) {
+            if (msync(seg.base, seg.size, MS_SYNC) != 0)
+                return false;
+        }
+
+        return true;
+    }
+
+    bool empty() const {
+        if (segments.empty())
+            return true;
+
+        const Segment &last = segments.back();
+        return head.seq == last.seq && head.pos >= last.write_pos;
+    }
+
+    std::size_t pending_bytes() const {
+        std::size_t bytes = 0;
+
+        for (const Segment &seg : segments) {
+            if (seg.seq == head.seq)
+                bytes += seg.write_pos - std::min<std::size_t>(head.pos, seg.write_pos);
+            else if (seg.seq > head.seq)
+                bytes += seg.write_pos;
+        }
+
+        return bytes;
+    }
+
+    /**
+     * 从当前head开始，依次对至多max_records条、总计约max_bytes字节的记录调用
+     * func(key, key_len, value, value_len)，指针直接指向映射的内存，在下一次consume
+     * 之前有效。返回值是这批记录之后的位置，生产成功后将它传给consume。
+    */
+    template<typename Func>
+    Position peek(std::size_t max_records, std::size_t max_bytes, Func func) const {
+        Position cur = head;
+        std::size_t cnt = 0, bytes = 0;
+
+        for (const Segment &seg : segments) {
+            if (seg.seq < head.seq)
+                continue;
+
+            std::size_t pos = (seg.seq == head.seq) ? head.pos : 0;
+            cur = Position{seg.seq, pos};
+
+            while (pos < seg.write_pos) {
+                if (cnt >= max_records || (cnt > 0 && bytes >= max_bytes))
+                    return cur;
+
+                uint32_t hdr[4];
+                std::memcpy(hdr, seg.base + pos, HEADER_SIZE);
+
+                const char *key = seg.base + pos + HEADER_SIZE;
+                const char *value = key + hdr[1];
+                func((const void *)key, (std::size_t)hdr[1],
+                     (const void *)value, (std::size_t)hdr[2]);
+
+                pos += HEADER_SIZE + hdr[1] + hdr[2];
+                bytes += hdr[1] + hdr[2];
+                ++cnt;
+                cur.pos = pos;
+            }
+        }
+
+        return cur;
+    }
+
+    // 确认pos之前的记录已成功生产，释放已完全回放的段
+    bool consume(const Position &pos) {
+        std::error_code ec;
+
+        head = pos;
+
+        while (!segments.empty() && segments.front().seq < head.seq) {
+            unmap_segment(segments.front());
+            std::filesystem::remove(segment_path(segments.front().seq), ec);
+            segments.pop_front();
+        }
+
+        // 全部回放完毕时直接删除剩余的段，下次从新的段开始写入
+        if (empty()) {
+            for (Segment &seg : segments) {
+                unmap_segment(seg);
+                std::filesystem::remove(segment_path(seg.seq), ec);
+            }
+
+            segments.clear();
+            head = Position{next_seq, 0};
+        }
+
+        return dump_head();
+    }
+
+private:
+    struct Segment {
+        uint64_t seq = 0;
+        int fd = -1;
+        char *base = nullptr;
+        std::size_t size = 0;
+        std::size_t write_pos = 0;
+    };
+
+    static constexpr uint32_t MAGIC = 0x4b53504c;
+    static constexpr std::size_t HEADER_SIZE = sizeof(uint32_t) * 4;
+
+    static uint32_t checksum(const void *key, std::size_t key_len,
+                             const void *value, std::size_t value_len)
+    {
+        // FNV-1a，只用于识别重启前未写完整的记录
+        uint32_t h = 2166136261u;
+        auto mix = [&h](const void *data, std::size_t len) {
+            const unsigned char *p = (const unsigned char *)data;
+            for (std::size_t i = 0; i < len; i++) {
+                h ^= p[i];
+                h *= 16777619u;
+            }
+        };
+
+        mix(key, key_len);
+        mix(value, value_len);
+        return h;
+    }
+
+    std::string segment_path(uint64_t seq) const {
+        return std::format("{}/{:020}.seg", dir, seq);
+    }
+
+    std::string head_path() const {
+        return dir + "/spool.head";
+    }
+
+    bool map_segment(uint64_t seq, bool create, Segment &seg) {
+        std::string path = segment_path(seq);
+        int flags = create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR;
+        int fd = ::open(path.c_str(), flags, 0644);
+        struct stat st;
+
+        if (fd < 0)
+            return false;
+
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+
+        // 已有的段保持原有大小；新建的段，以及创建后还未来得及预分配的空文件，
+        // 通过ftruncate预分配，未写入的区域全部为0，不会被误认为记录
+        std::size_t size = (std::size_t)st.st_size;
+        if (size == 0) {
+            size = segment_size;
+            if (ftruncate(fd, (off_t)size) != 0) {
+                ::close(fd);
+                return false;
+            }
+        }
+
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            ::close(fd);
+            return false;
+        }
+
+        seg.seq = seq;
+        seg.fd = fd;
+        seg.base = (char *)p;
+        seg.size = size;
+        seg.write_pos = 0;
+        return true;
+    }
+
+    std::size_t disk_bytes() const {
+        std::size_t bytes = 0;
+
+        for (const Segment &seg : segments)
+            bytes += seg.size;
+
+        return bytes;
+    }
+
+    void unmap_segment(Segment &seg) {
+        if (seg.base) {
+            munmap(seg.base, seg.size);
+            seg.base = nullptr;
+        }
+
+        if (seg.fd >= 0) {
+            ::close(seg.fd);
+            seg.fd = -1;
+        }
+    }
+
+    std::size_t scan_segment(const Segment &seg) const {
+        std::size_t pos = 0;
+
+        while (pos + HEADER_SIZE <= seg.size) {
+            uint32_t hdr[4];
+            std::memcpy(hdr, seg.base + pos, HEADER_SIZE);
+
+            if (hdr[0] != MAGIC)
+                break;
+
+            std::size_t len = HEADER_SIZE + (std::size_t)hdr[1] + hdr[2];
+            if (pos + len > seg.size)
+                break;
+
+            const char *key = seg.base + pos + HEADER_SIZE;
+            if (checksum(key, hdr[1], key + hdr[1], hdr[2]) != hdr[3])
+                break;
+
+            pos += len;
+        }
+
+        return pos;
+    }
+
+    void load_head() {
+        std::ifstream ifs(head_path());
+        uint64_t seq, pos;
+
+        if (ifs >> seq >> pos)
+            head = Position{seq, pos};
+        else
+            head = Position{0, 0};
+    }
+
+    bool dump_head() {
+        std::string tmp = head_path() + ".tmp";
+        std::error_code ec;
+
+        {
+            std::ofstream ofs(tmp, std::ios::trunc);
+            if (!ofs.good())
+                return false;
+
+            ofs << head.seq << ' ' << head.pos << std::endl;
+            if (!ofs.good())
+                return false;
+        }
+
+        // 通过rename原子地替换head文件，避免重启时读到写了一半的内容
+        std::filesystem::rename(tmp, head_path(), ec);
+        return !ec;
+    }
+
+private:
+    std::string dir;
+    std::size_t segment_size{0};
+    std::size_t max_bytes{0};
+    uint64_t next_seq{0};
+    Position head{0, 0};
+    std::deque<Segment> segments;
+};
+
+#endif // KAFKA_EXAMPLE_PRODUCE_SPOOL_H
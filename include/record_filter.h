@@ -0,0 +1,389 @@
+#ifndef KAFKA_EXAMPLE_RECORD_FILTER_H
+#define KAFKA_EXAMPLE_RECORD_FILTER_H
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KAFKA_EXAMPLE_FILTER_X86 1
+#endif
+
+#include "show_result.h"
+
+/**
+ * 位于fetch_records与处理逻辑之间的过滤阶段，只保留满足条件的记录。
+ *
+ * 过滤条件由若干个以`;`分隔的子句组成，所有子句都满足时记录才会保留：
+ *     header:NAME=VALUE    存在名为NAME且值为VALUE的header
+ *     key-prefix:PREFIX    key以PREFIX开头
+ *     contains:BYTES       value中包含BYTES
+ *     json:FIELD=VALUE     value中存在"FIELD": VALUE，VALUE为字符串时需带双引号，
+ *                          例如json:type="click"或json:level=3
+ *
+ * json子句并不解析JSON，只是查找字段名后比较紧随其后的值，因此嵌套对象中的同名字段
+ * 也会被匹配。子串查找使用SSE2/AVX2向量化实现，不支持的平台上退化为标量实现。
+ *
+ * 过滤只影响交给处理逻辑的记录，被丢弃的记录的offset仍然需要推进，因此调用者应当
+ * 继续使用过滤前的结果调用update_toppars或创建commit任务。
+*/
+
+namespace record_filter_detail {
+
+inline const char *find_scalar(const char *s, std::size_t n, const char *needle, std::size_t m) {
+    if (m == 0)
+        return s;
+
+    const char *end = s + n;
+    while (m <= (std::size_t)(end - s)) {
+        const char *p = (const char *)std::memchr(s, needle[0], end - s - m + 1);
+        if (!p)
+            return nullptr;
+
+        if (std::memcmp(p + 1, needle + 1, m - 1) == 0)
+            return p;
+
+        s = p + 1;
+    }
+
+    return nullptr;
+}
+
+#ifdef KAFKA_EXAMPLE_FILTER_X86
+
+/**
+ * 同时比较needle的首字节和尾字节，两者都相等的位置才需要逐字节比较中间部分，
+ * 对于常见的数据，绝大多数位置在一次向量比较中就被排除了。
+*/
+__attribute__((target("sse2")))
+inline const char *find_sse2(const char *s, std::size_t n, const char *needle, std::size_t m) {
+    if (m == 0)
+        return s;
+    if (m > n)
+        return nullptr;
+
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    std::size_t i = 0;
+
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i bf = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i bl = _mm_loadu_si128((const __m128i *)(s + i + m - 1));
+        __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl));
+        unsigned mask = (unsigned)_mm_movemask_epi8(eq);
+
+        while (mask) {
+            unsigned bit = __builtin_ctz(mask);
+            if (m <= 2 || std::memcmp(s + i + bit + 1, needle + 1, m - 2) == 0)
+                return s + i + bit;
+
+            mask &= mask - 1;
+        }
+    }
+
+    return find_scalar(s + i, n - i, needle, m);
+}
+
+__attribute__((target("avx2")))
+inline const char *find_avx2(const char *s, std::size_t n, const char *needle, std::size_t m) {
+    if (m == 0)
+        return s;
+    if (m > n)
+        return nullptr;
+
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    std::size_t i = 0;
+
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i bf = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i bl = _mm256_loadu_si256((const __m256i *)(s + i + m - 1));
+        __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(first, bf), _mm256_cmpeq_epi8(last, bl));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(eq);
+
+        while (mask) {
+            unsigned bit = __builtin_ctz(mask);
+            if (m <= 2 || std::memcmp(s + i + bit + 1, needle + 1, m - 2) == 0)
+                return s + i + bit;
+
+            mask &= mask - 1;
+        }
+    }
+
+    return find_sse2(s + i, n - i, needle, m);
+}
+
+#endif // KAFKA_EXAMPLE_FILTER_X86
+
+using find_func_t = const char *(*)(const char *, std::size_t, const char *, std::size_t);
+
+} // namespace record_filter_detail
+
+enum class ScanImpl {
+    SCALAR,
+    SSE2,
+    AVX2,
+};
+
+inline bool scan_impl_supported(ScanImpl impl) {
+#ifdef KAFKA_EXAMPLE_FILTER_X86
+    if (impl == ScanImpl::AVX2)
+        return __builtin_cpu_supports("avx2");
+    if (impl == ScanImpl::SSE2)
+        return __builtin_cpu_supports("sse2");
+    return true;
+#else
+    return impl == ScanImpl::SCALAR;
+#endif
+}
+
+inline record_filter_detail::find_func_t scan_func(ScanImpl impl) {
+#ifdef KAFKA_EXAMPLE_FILTER_X86
+    if (impl == ScanImpl::AVX2)
+        return record_filter_detail::find_avx2;
+    if (impl == ScanImpl::SSE2)
+        return record_filter_detail::find_sse2;
+#endif
+    return record_filter_detail::find_scalar;
+}
+
+// 当前cpu支持的最快实现
+inline ScanImpl best_scan_impl() {
+    if (scan_impl_supported(ScanImpl::AVX2))
+        return ScanImpl::AVX2;
+    if (scan_impl_supported(ScanImpl::SSE2))
+        return ScanImpl::SSE2;
+    return ScanImpl::SCALAR;
+}
+
+class RecordFilter {
+public:
+    RecordFilter() : find(scan_func(best_scan_impl())) { }
+
+    // 主要用于性能测试，指定的实现必须被当前cpu支持
+    void set_scan_impl(ScanImpl impl) {
+        find = scan_func(impl);
+    }
+
+    bool parse(const std::string &spec) {
+        std::size_t pos = 0;
+
+        clauses.clear();
+        while (pos < spec.size()) {
+            std::size_t end = spec.find(';', pos);
+            if (end == std::string::npos)
+                end = spec.size();
+
+            if (end > pos && !parse_clause(spec.substr(pos, end - pos)))
+                return false;
+
+            pos = end + 1;
+        }
+
+        return true;
+    }
+
+    bool empty() const {
+        return clauses.empty();
+    }
+
+    bool match(const protocol::KafkaRecord &rec) const {
+        for (const Clause &c : clauses) {
+            if (!match_clause(c, rec))
+                return false;
+        }
+
+        return true;
+    }
+
+    // 只检查作用于value的子句，供性能测试直接对内存中的数据使用
+    bool match_value(const void *value, std::size_t value_len) const {
+        for (const Clause &c : clauses) {
+            if (c.type == CONTAINS && !match_contains(c, value, value_len))
+                return false;
+            if (c.type == JSON && !match_json(c, value, value_len))
+                return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * 检查重组后的消息。重组后的消息只有value，没有key和headers，因此存在header或
+     * key-prefix子句时不会匹配。
+    */
+    bool match_message(const void *value, std::size_t value_len) const {
+        for (const Clause &c : clauses) {
+            if (c.type == HEADER || c.type == KEY_PREFIX)
+                return false;
+        }
+
+        return match_value(value, value_len);
+    }
+
+    /**
+     * 将vec_records中满足条件的记录指针放入out，out与vec_records一一对应，
+     * 某个partition的记录全部被丢弃时对应的元素为空。
+    */
+    std::size_t filter(const vec_records_t &vec_records, vec_records_t &out) const {
+        std::size_t kept = 0;
+
+        out.clear();
+        out.resize(vec_records.size());
+
+        for (std::size_t i = 0; i < vec_records.size(); i++) {
+            for (auto *rec : vec_records[i]) {
+                if (match(*rec)) {
+                    out[i].push_back(rec);
+                    ++kept;
+                }
+            }
+        }
+
+        return kept;
+    }
+
+private:
+    enum ClauseType {
+        HEADER,
+        KEY_PREFIX,
+        CONTAINS,
+        JSON,
+    };
+
+    struct Clause {
+        ClauseType type;
+        std::string name;
+        std::string value;
+        bool raw;
+    };
+
+    bool parse_clause(const std::string &str) {
+        std::size_t colon = str.find(':');
+        if (colon == std::string::npos)
+            return false;
+
+        std::string kind = str.substr(0, colon);
+        std::string arg = str.substr(colon + 1);
+        Clause c{HEADER, "", "", false};
+
+        if (kind == "key-prefix" || kind == "contains") {
+            if (arg.empty())
+                return false;
+
+            c.type = (kind == "contains") ? CONTAINS : KEY_PREFIX;
+            c.value = std::move(arg);
+        }
+        else if (kind == "header" || kind == "json") {
+            std::size_t eq = arg.find('=');
+            if (eq == std::string::npos || eq == 0)
+                return false;
+
+            c.type = (kind == "json") ? JSON : HEADER;
+            c.name = arg.substr(0, eq);
+            c.value = arg.substr(eq + 1);
+
+            if (c.type == JSON) {
+                // 预先拼好带引号的字段名，查找时作为needle使用
+                c.name = "\"" + c.name + "\"";
+                c.raw = c.value.empty() || c.value[0] != '"';
+                if (c.value.empty())
+                    return false;
+            }
+        }
+        else
+            return false;
+
+        clauses.push_back(std::move(c));
+        return true;
+    }
+
+    bool match_clause(const Clause &c, const protocol::KafkaRecord &rec) const {
+        const void *data;
+        std::size_t len;
+
+        switch (c.type) {
+        case HEADER:
+            return match_header(c, rec);
+
+        case KEY_PREFIX:
+            rec.get_key(&data, &len);
+            return len >= c.value.size() && std::memcmp(data, c.value.data(), c.value.size()) == 0;
+
+        case CONTAINS:
+            rec.get_value(&data, &len);
+            return match_contains(c, data, len);
+
+        case JSON:
+            rec.get_value(&data, &len);
+            return match_json(c, data, len);
+        }
+
+        return false;
+    }
+
+    static bool match_header(const Clause &c, const protocol::KafkaRecord &rec) {
+        protocol::KafkaHeaderCursor cursor(rec.get_header_list());
+        const void *key, *value;
+        std::size_t key_len, value_len;
+
+        while (cursor.next(&key, &key_len, &value, &value_len)) {
+            if (key_len == c.name.size() && value_len == c.value.size() &&
+                std::memcmp(key, c.name.data(), key_len) == 0 &&
+                std::memcmp(value, c.value.data(), value_len) == 0)
+                return true;
+        }
+
+        return false;
+    }
+
+    bool match_contains(const Clause &c, const void *data, std::size_t len) const {
+        return find((const char *)data, len, c.value.data(), c.value.size()) != nullptr;
+    }
+
+    bool match_json(const Clause &c, const void *data, std::size_t len) const {
+        const char *s = (const char *)data;
+        const char *end = s + len;
+
+        while (s < end) {
+            const char *p = find(s, end - s, c.name.data(), c.name.size());
+            if (!p)
+                return false;
+
+            const char *q = skip_space(p + c.name.size(), end);
+            if (q < end && *q == ':') {
+                q = skip_space(q + 1, end);
+
+                std::size_t vlen = c.value.size();
+                if ((std::size_t)(end - q) >= vlen && std::memcmp(q, c.value.data(), vlen) == 0) {
+                    // 非字符串的值需要完整匹配，避免level=3匹配到"level": 30
+                    if (!c.raw || q + vlen == end || is_delimiter(q[vlen]))
+                        return true;
+                }
+            }
+
+            s = p + 1;
+        }
+
+        return false;
+    }
+
+    static const char *skip_space(const char *p, const char *end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+            ++p;
+
+        return p;
+    }
+
+    static bool is_delimiter(char ch) {
+        return ch == ',' || ch == '}' || ch == ']' || ch == ' ' ||
+               ch == '\t' || ch == '\r' || ch == '\n';
+    }
+
+private:
+    record_filter_detail::find_func_t find;
+    std::vector<Clause> clauses;
+};
+
+#endif // KAFKA_EXAMPLE_RECORD_FILTER_H
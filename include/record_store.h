@@ -0,0 +1,678 @@
+#ifndef KAFKA_EXAMPLE_RECORD_STORE_H
+#define KAFKA_EXAMPLE_RECORD_STORE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <map>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "show_result.h"
+#include "topic_manager.h"
+
+/**
+ * 将消费到的数据按topic-partition保存到本地的段文件中，便于开发过程中反复回放同一份
+ * 数据，而不必每次都从集群拉取。目录结构为
+ *
+ *     <dir>/<topic>-<partition>/<base_offset>.log
+ *     <dir>/<topic>-<partition>/<base_offset>.index
+ *     <dir>/<topic>-<partition>/<base_offset>.timeindex
+ *
+ * log中每条记录的格式为 | magic | key_len | value_len | offset | timestamp | key | value |，
+ * 不保存headers。每写入index_interval字节，向index追加一项(offset, position)，向
+ * timeindex追加一项(该位置之前的最大timestamp, offset)，读取时用于按offset或时间定位。
+ *
+ * append只写入page cache，调用flush成功后数据才是持久的，此时才可以提交offset。
+ * 新建的分区目录和段文件需要fsync所在目录，否则掉电后目录项可能丢失，flush也会
+ * 一并处理。
+*/
+
+struct StoredRecord {
+    long long offset;
+    long long timestamp;
+    const void *key;
+    std::size_t key_len;
+    const void *value;
+    std::size_t value_len;
+};
+
+namespace record_store_detail {
+
+constexpr uint32_t MAGIC = 0x4b524543;
+
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t key_len;
+    uint32_t value_len;
+    uint32_t reserved;
+    int64_t offset;
+    int64_t timestamp;
+};
+
+struct IndexEntry {
+    int64_t offset;
+    uint64_t position;
+};
+
+struct TimeIndexEntry {
+    int64_t timestamp;
+    int64_t offset;
+};
+
+inline std::string partition_dir(const std::string &dir, const std::string &topic,
+                                 int partition)
+{
+    return std::format("{}/{}-{}", dir, topic, partition);
+}
+
+inline std::string segment_path(const std::string &pdir, long long base, const char *ext) {
+    return std::format("{}/{:020}{}", pdir, base, ext);
+}
+
+// 返回目录中所有段的起始offset，按从小到大排序
+inline std::vector<long long> list_segments(const std::string &pdir) {
+    namespace fs = std::filesystem;
+    std::vector<long long> bases;
+    std::error_code ec;
+
+    for (const auto &entry : fs::directory_iterator(pdir, ec)) {
+        const fs::path &p = entry.path();
+        if (p.extension() != ".log")
+            continue;
+
+        try {
+            bases.push_back(std::stoll(p.stem().string()));
+        }
+        catch (...) {
+            continue;
+        }
+    }
+
+    std::sort(bases.begin(), bases.end());
+    return bases;
+}
+
+// 新建或删除目录项后需要fsync所在的目录，目录项才是持久的
+inline bool fsync_dir(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return false;
+
+    int ret = fsync(fd);
+    ::close(fd);
+    return ret == 0;
+}
+
+inline bool write_all(int fd, const void *data, std::size_t len) {
+    const char *p = (const char *)data;
+
+    while (len > 0) {
+        ssize_t n = ::write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+} // namespace record_store_detail
+
+class RecordStore {
+public:
+    RecordStore() = default;
+    ~RecordStore() { close(); }
+
+    RecordStore(const RecordStore &) = delete;
+    RecordStore &operator= (const RecordStore &) = delete;
+
+    bool open(const std::string &dir, std::size_t segment_bytes,
+              std::size_t index_interval = 4096)
+    {
+        std::error_code ec;
+        bool created = std::filesystem::create_directories(dir, ec);
+        if (ec)
+            return false;
+
+        if (created) {
+            std::filesystem::path path(dir);
+            if (!path.has_filename())
+                path = path.parent_path();
+
+            std::string parent = path.parent_path().string();
+            if (!record_store_detail::fsync_dir(parent.empty() ? "." : parent))
+                return false;
+        }
+
+        this->dir = dir;
+        this->segment_bytes = segment_bytes;
+        this->index_interval = index_interval;
+        return true;
+    }
+
+    void close() {
+        for (auto &[key, p] : partitions)
+            close_segment(p);
+
+        partitions.clear();
+    }
+
+    /**
+     * 追加一批拉取到的数据。重复拉取到的、offset不大于已保存最大offset的记录会被跳过，
+     * 因此在flush之前异常退出并从已提交的offset重新拉取也不会产生重复数据。
+    */
+    bool append(const vec_records_t &vec_records) {
+        for (const auto &records : vec_records) {
+            if (records.empty())
+                continue;
+
+            const protocol::KafkaRecord *first = records.front();
+            Partition *p = get_partition(first->get_topic(), first->get_partition());
+            if (!p)
+                return false;
+
+            for (const auto *rec : records) {
+                if (!append_record(*p, *rec))
+                    return false;
+            }
+
+            if (!write_pending(*p))
+                return false;
+        }
+
+        return true;
+    }
+
+    // 将所有已追加的数据刷到磁盘
+    bool flush() {
+        for (auto &[key, p] : partitions) {
+            if (p.dirty) {
+                if (fsync(p.log_fd) != 0 || fsync(p.index_fd) != 0 ||
+                    fsync(p.time_fd) != 0)
+                    return false;
+
+                p.dirty = false;
+            }
+
+            if (p.dir_dirty) {
+                if (!record_store_detail::fsync_dir(p.pdir))
+                    return false;
+
+                p.dir_dirty = false;
+            }
+        }
+
+        return true;
+    }
+
+private:
+    using RecordHeader = record_store_detail::RecordHeader;
+    using IndexEntry = record_store_detail::IndexEntry;
+    using TimeIndexEntry = record_store_detail::TimeIndexEntry;
+
+    struct Partition {
+        std::string pdir;
+        int log_fd{-1};
+        int index_fd{-1};
+        int time_fd{-1};
+        long long base{-1};
+        uint64_t size{0};
+        uint64_t last_index_pos{0};
+        long long last_offset{-1};
+        long long max_ts{LLONG_MIN};
+        bool dirty{false};
+        bool dir_dirty{false};
+
+        std::string log_buf;
+        std::string index_buf;
+        std::string time_buf;
+    };
+
+    Partition *get_partition(const std::string &topic, int partition) {
+        TopicManager::TopparKey key{topic, partition};
+        auto it = partitions.find(key);
+        if (it != partitions.end())
+            return &it->second;
+
+        Partition p;
+        std::error_code ec;
+
+        p.pdir = record_store_detail::partition_dir(dir, topic, partition);
+        bool created = std::filesystem::create_directories(p.pdir, ec);
+        if (ec)
+            return nullptr;
+
+        // 新建的分区目录要在上层目录中持久化
+        if (created && !record_store_detail::fsync_dir(dir))
+            return nullptr;
+
+        auto bases = record_store_detail::list_segments(p.pdir);
+        if (!bases.empty() && !recover_segment(p, bases.back()))
+            return nullptr;
+
+        auto res = partitions.emplace(std::move(key), std::move(p));
+        return &res.first->second;
+    }
+
+    /**
+     * 重新打开最后一个段继续写入。扫描log找到最后一条完整的记录，截断其后的内容；
+     * index中指向截断位置之后的项也一并截断。
+    */
+    bool recover_segment(Partition &p, long long base) {
+        std::string log_path = record_store_detail::segment_path(p.pdir, base, ".log");
+        int fd = ::open(log_path.c_str(), O_RDONLY);
+        struct stat st;
+        uint64_t pos = 0;
+
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0)
+                ::close(fd);
+            return false;
+        }
+
+        p.base = base;
+        p.max_ts = LLONG_MIN;
+
+        if (st.st_size > 0) {
+            void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (m == MAP_FAILED) {
+                ::close(fd);
+                return false;
+            }
+
+            const char *data = (const char *)m;
+            while (pos + sizeof(RecordHeader) <= (uint64_t)st.st_size) {
+                RecordHeader hdr;
+                std::memcpy(&hdr, data + pos, sizeof(hdr));
+
+                uint64_t len = sizeof(hdr) + hdr.key_len + hdr.value_len;
+                if (hdr.magic != record_store_detail::MAGIC || pos + len > (uint64_t)st.st_size)
+                    break;
+
+                p.last_offset = hdr.offset;
+                p.max_ts = std::max<long long>(p.max_ts, hdr.timestamp);
+                pos += len;
+            }
+
+            munmap(m, st.st_size);
+        }
+
+        ::close(fd);
+
+        // 段在创建后、写入第一条记录前进程退出时为空，此时上一个段中的记录都小于base，
+        // 以base - 1作为已保存的最大offset，避免重新拉取的旧记录被追加到这个段中
+        if (p.last_offset < 0)
+            p.last_offset = base - 1;
+
+        if (!open_segment(p, base, false))
+            return false;
+
+        if (ftruncate(p.log_fd, pos) != 0)
+            return false;
+
+        p.size = pos;
+        return truncate_index(p);
+    }
+
+    bool truncate_index(Partition &p) {
+        struct stat st;
+        if (fstat(p.index_fd, &st) != 0)
+            return false;
+
+        std::size_t n = st.st_size / sizeof(IndexEntry);
+        std::vector<IndexEntry> entries(n);
+
+        if (n > 0 && pread(p.index_fd, entries.data(), n * sizeof(IndexEntry), 0)
+                        != (ssize_t)(n * sizeof(IndexEntry)))
+            return false;
+
+        std::size_t keep = 0;
+        while (keep < n && entries[keep].position < p.size)
+            ++keep;
+
+        p.last_index_pos = keep > 0 ? entries[keep - 1].position : 0;
+
+        if (ftruncate(p.index_fd, keep * sizeof(IndexEntry)) != 0)
+            return false;
+
+        if (ftruncate(p.time_fd, keep * sizeof(TimeIndexEntry)) != 0)
+            return false;
+
+        lseek(p.index_fd, 0, SEEK_END);
+        lseek(p.time_fd, 0, SEEK_END);
+        return true;
+    }
+
+    bool open_segment(Partition &p, long long base, bool create) {
+        int flags = O_RDWR | O_CREAT | (create ? O_TRUNC : 0);
+        auto path = [&p, base](const char *ext) {
+            return record_store_detail::segment_path(p.pdir, base, ext);
+        };
+
+        p.log_fd = ::open(path(".log").c_str(), flags, 0644);
+        p.index_fd = ::open(path(".index").c_str(), flags, 0644);
+        p.time_fd = ::open(path(".timeindex").c_str(), flags, 0644);
+
+        if (p.log_fd < 0 || p.index_fd < 0 || p.time_fd < 0) {
+            close_segment(p);
+            return false;
+        }
+
+        lseek(p.log_fd, 0, SEEK_END);
+        p.base = base;
+        return true;
+    }
+
+    void close_segment(Partition &p) {
+        for (int *fd : {&p.log_fd, &p.index_fd, &p.time_fd}) {
+            if (*fd >= 0) {
+                ::close(*fd);
+                *fd = -1;
+            }
+        }
+    }
+
+    bool roll_segment(Partition &p, long long base) {
+        // 旧段在关闭前必须持久化，之后flush只会处理当前段
+        if (p.log_fd >= 0) {
+            if (!write_pending(p) || fsync(p.log_fd) != 0 ||
+                fsync(p.index_fd) != 0 || fsync(p.time_fd) != 0)
+                return false;
+
+            close_segment(p);
+        }
+
+        if (!open_segment(p, base, true))
+            return false;
+
+        p.dir_dirty = true;
+        p.size = 0;
+        p.last_index_pos = 0;
+        p.max_ts = LLONG_MIN;
+        return true;
+    }
+
+    bool append_record(Partition &p, const protocol::KafkaRecord &rec) {
+        long long offset = rec.get_offset();
+        if (offset <= p.last_offset)
+            return true;
+
+        const void *key, *value;
+        std::size_t key_len, value_len;
+
+        rec.get_key(&key, &key_len);
+        rec.get_value(&value, &value_len);
+
+        uint64_t pending = p.log_buf.size();
+        if (p.log_fd < 0 || (p.size + pending > 0 && p.size + pending >= segment_bytes)) {
+            if (!roll_segment(p, offset))
+                return false;
+        }
+
+        uint64_t pos = p.size + p.log_buf.size();
+        RecordHeader hdr{
+            record_store_detail::MAGIC,
+            (uint32_t)key_len,
+            (uint32_t)value_len,
+            0,
+            offset,
+            rec.get_timestamp(),
+        };
+
+        // 每个段的第一条记录总是建立索引，之后每隔index_interval字节建立一次
+        if (pos == 0 || pos - p.last_index_pos >= index_interval) {
+            IndexEntry ie{offset, pos};
+            TimeIndexEntry te{p.max_ts, offset};
+
+            p.index_buf.append((const char *)&ie, sizeof(ie));
+            p.time_buf.append((const char *)&te, sizeof(te));
+            p.last_index_pos = pos;
+        }
+
+        p.log_buf.append((const char *)&hdr, sizeof(hdr));
+        if (key_len)
+            p.log_buf.append((const char *)key, key_len);
+        if (value_len)
+            p.log_buf.append((const char *)value, value_len);
+
+        p.last_offset = offset;
+        p.max_ts = std::max<long long>(p.max_ts, hdr.timestamp);
+        return true;
+    }
+
+    bool write_pending(Partition &p) {
+        using record_store_detail::write_all;
+
+        // 先写log再写索引，异常退出时索引至多落后于log，不会指向不存在的数据
+        if (!write_all(p.log_fd, p.log_buf.data(), p.log_buf.size()) ||
+            !write_all(p.index_fd, p.index_buf.data(), p.index_buf.size()) ||
+            !write_all(p.time_fd, p.time_buf.data(), p.time_buf.size()))
+            return false;
+
+        if (!p.log_buf.empty())
+            p.dirty = true;
+
+        p.size += p.log_buf.size();
+        p.log_buf.clear();
+        p.index_buf.clear();
+        p.time_buf.clear();
+        return true;
+    }
+
+private:
+    std::string dir;
+    std::size_t segment_bytes{0};
+    std::size_t index_interval{0};
+    std::map<TopicManager::TopparKey, Partition> partitions;
+};
+
+/**
+ * 读取RecordStore保存的某个topic-partition的数据。段文件通过mmap映射，next返回的
+ * StoredRecord直接指向映射的内存，在读取到下一个段之前有效。
+*/
+class RecordStoreReader {
+public:
+    RecordStoreReader() = default;
+    ~RecordStoreReader() { unmap(); }
+
+    RecordStoreReader(const RecordStoreReader &) = delete;
+    RecordStoreReader &operator= (const RecordStoreReader &) = delete;
+
+    bool open(const std::string &dir, const std::string &topic, int partition) {
+        pdir = record_store_detail::partition_dir(dir, topic, partition);
+        bases = record_store_detail::list_segments(pdir);
+
+        if (bases.empty())
+            return false;
+
+        return map_segment(0, 0);
+    }
+
+    // 定位到第一条offset不小于target的记录
+    bool seek_offset(long long target) {
+        auto it = std::upper_bound(bases.begin(), bases.end(), target);
+        std::size_t idx = (it == bases.begin()) ? 0 : (it - bases.begin() - 1);
+
+        auto index = load_index<IndexEntry>(bases[idx], ".index");
+        auto pit = std::upper_bound(index.begin(), index.end(), target,
+            [](long long t, const IndexEntry &e) { return t < e.offset; });
+        uint64_t pos = (pit == index.begin()) ? 0 : (pit - 1)->position;
+
+        if (!map_segment(idx, pos))
+            return false;
+
+        return skip_until([target](const RecordHeader &h) { return h.offset >= target; }, true);
+    }
+
+    // 定位到第一条timestamp不小于target的记录
+    bool seek_time(long long target) {
+        for (std::size_t idx = 0; idx < bases.size(); idx++) {
+            auto tindex = load_index<TimeIndexEntry>(bases[idx], ".timeindex");
+            auto index = load_index<IndexEntry>(bases[idx], ".index");
+            uint64_t pos = 0;
+
+            // timeindex中记录的是该索引位置之前的最大timestamp，最后一个小于target的
+            // 索引项之前的数据都可以跳过
+            for (std::size_t i = 0; i < tindex.size() && i < index.size(); i++) {
+                if (tindex[i].timestamp >= target)
+                    break;
+                pos = index[i].position;
+            }
+
+            if (!map_segment(idx, pos))
+                return false;
+
+            auto pred = [target](const RecordHeader &h) { return h.timestamp >= target; };
+            if (skip_until(pred, false))
+                return true;
+        }
+
+        return false;
+    }
+
+    bool next(StoredRecord &rec) {
+        while (true) {
+            RecordHeader hdr;
+            if (read_header(hdr)) {
+                const char *p = data + pos + sizeof(hdr);
+
+                rec.offset = hdr.offset;
+                rec.timestamp = hdr.timestamp;
+                rec.key = p;
+                rec.key_len = hdr.key_len;
+                rec.value = p + hdr.key_len;
+                rec.value_len = hdr.value_len;
+
+                pos += sizeof(hdr) + hdr.key_len + hdr.value_len;
+                return true;
+            }
+
+            if (cur + 1 >= bases.size() || !map_segment(cur + 1, 0))
+                return false;
+        }
+    }
+
+private:
+    using RecordHeader = record_store_detail::RecordHeader;
+    using IndexEntry = record_store_detail::IndexEntry;
+    using TimeIndexEntry = record_store_detail::TimeIndexEntry;
+
+    template<typename Entry>
+    std::vector<Entry> load_index(long long base, const char *ext) {
+        std::string path = record_store_detail::segment_path(pdir, base, ext);
+        std::vector<Entry> entries;
+        int fd = ::open(path.c_str(), O_RDONLY);
+        struct stat st;
+
+        if (fd < 0)
+            return entries;
+
+        if (fstat(fd, &st) == 0) {
+            entries.resize(st.st_size / sizeof(Entry));
+            std::size_t len = entries.size() * sizeof(Entry);
+
+            if (pread(fd, entries.data(), len, 0) != (ssize_t)len)
+                entries.clear();
+        }
+
+        ::close(fd);
+        return entries;
+    }
+
+    bool map_segment(std::size_t idx, uint64_t start) {
+        unmap();
+
+        std::string path = record_store_detail::segment_path(pdir, bases[idx], ".log");
+        int fd = ::open(path.c_str(), O_RDONLY);
+        struct stat st;
+
+        if (fd < 0)
+            return false;
+
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+
+        if (st.st_size > 0) {
+            void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (m == MAP_FAILED) {
+                ::close(fd);
+                return false;
+            }
+
+            // 回放时顺序读取，提示内核预读
+            madvise(m, st.st_size, MADV_SEQUENTIAL);
+            data = (const char *)m;
+        }
+
+        ::close(fd);
+
+        size = st.st_size;
+        cur = idx;
+        pos = std::min<uint64_t>(start, size);
+        return true;
+    }
+
+    void unmap() {
+        if (data) {
+            munmap((void *)data, size);
+            data = nullptr;
+        }
+
+        size = 0;
+        pos = 0;
+    }
+
+    bool read_header(RecordHeader &hdr) const {
+        if (pos + sizeof(hdr) > size)
+            return false;
+
+        std::memcpy(&hdr, data + pos, sizeof(hdr));
+        return hdr.magic == record_store_detail::MAGIC &&
+               pos + sizeof(hdr) + hdr.key_len + hdr.value_len <= size;
+    }
+
+    // 向前跳过记录直到pred满足，停在该记录之前；follow表示是否继续查找之后的段
+    template<typename Pred>
+    bool skip_until(Pred pred, bool follow) {
+        while (true) {
+            RecordHeader hdr;
+            while (read_header(hdr)) {
+                if (pred(hdr))
+                    return true;
+
+                pos += sizeof(hdr) + hdr.key_len + hdr.value_len;
+            }
+
+            if (!follow || cur + 1 >= bases.size() || !map_segment(cur + 1, 0))
+                return false;
+        }
+    }
+
+private:
+    std::string pdir;
+    std::vector<long long> bases;
+    std::size_t cur{0};
+    const char *data{nullptr};
+    uint64_t size{0};
+    uint64_t pos{0};
+};
+
+#endif // KAFKA_EXAMPLE_RECORD_STORE_H
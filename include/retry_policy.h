@@ -0,0 +1,220 @@
+#ifndef KAFKA_EXAMPLE_RETRY_POLICY_H
+#define KAFKA_EXAMPLE_RETRY_POLICY_H
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <format>
+#include <mutex>
+#include <random>
+#include <string>
+
+#include "workflow/WFKafkaClient.h"
+
+/**
+ * 失败任务的重试策略，包含带抖动的指数退避和按错误类别划分的熔断器。
+ *
+ * 每个WFKafkaClient(即一组broker)对应一个RetryPolicy对象，使用方式为:
+ * 1. 创建任务前调用before_request，若返回值大于0，则等待这段时间后再尝试；
+ * 2. 任务完成后根据结果调用on_success或on_failure，后者返回本次应等待的时间。
+ *
+ * 同一类错误连续出现failure_threshold次后熔断器打开，在[open_time/2, open_time]内
+ * 随机的一段时间里拒绝新的请求；之后进入半开状态，仅放行一个探测请求，成功则关闭
+ * 熔断器，失败则重新打开。抖动使大量客户端在同一时刻失败或熔断后不会在同一时刻重试
+ * 或探测。
+*/
+
+struct RetryOptions {
+    std::chrono::milliseconds base_delay{100};
+    std::chrono::milliseconds max_delay{30000};
+    double multiplier{2.0};
+    int failure_threshold{5};
+    std::chrono::milliseconds open_time{10000};
+};
+
+class RetryPolicy {
+public:
+    using clock_type = std::chrono::steady_clock;
+    using duration_type = std::chrono::milliseconds;
+
+    enum ErrorClass {
+        ERROR_NETWORK = 0,
+        ERROR_TIMEOUT,
+        ERROR_KAFKA,
+        ERROR_OTHER,
+        ERROR_CLASS_MAX,
+    };
+
+    enum BreakerState {
+        BREAKER_CLOSED = 0,
+        BREAKER_OPEN,
+        BREAKER_HALF_OPEN,
+    };
+
+    RetryPolicy(std::string name, const RetryOptions &opt = RetryOptions())
+        : name(std::move(name)), opt(opt), rng(std::random_device{}())
+    { }
+
+    static ErrorClass classify(int state, int error) {
+        switch (state) {
+        case WFT_STATE_SYS_ERROR:
+            return error == ETIMEDOUT ? ERROR_TIMEOUT : ERROR_NETWORK;
+        case WFT_STATE_DNS_ERROR:
+        case WFT_STATE_SSL_ERROR:
+            return ERROR_NETWORK;
+        case WFT_STATE_TASK_ERROR:
+            return ERROR_KAFKA;
+        default:
+            return ERROR_OTHER;
+        }
+    }
+
+    static const char *class_name(int cls) {
+        static const char *names[] = {"network", "timeout", "kafka", "other"};
+        return names[cls];
+    }
+
+    /**
+     * 返回0表示可以发起请求，否则返回需要等待的时间。熔断器处于半开状态时，
+     * 只有第一个调用者会得到放行。
+    */
+    duration_type before_request() {
+        std::lock_guard<std::mutex> lg(mtx);
+        auto now = clock_type::now();
+        duration_type wait{0};
+
+        for (Breaker &b : breakers) {
+            if (b.state == BREAKER_OPEN) {
+                if (now >= b.open_until) {
+                    b.state = BREAKER_HALF_OPEN;
+                    b.probing = false;
+                }
+                else {
+                    auto left = std::chrono::ceil<duration_type>(b.open_until - now);
+                    wait = std::max(wait, left);
+                }
+            }
+
+            if (b.state == BREAKER_HALF_OPEN && b.probing)
+                wait = std::max(wait, opt.base_delay);
+        }
+
+        if (wait.count() > 0) {
+            ++rejected;
+            return wait;
+        }
+
+        for (Breaker &b : breakers) {
+            if (b.state == BREAKER_HALF_OPEN)
+                b.probing = true;
+        }
+
+        return wait;
+    }
+
+    void on_success() {
+        std::lock_guard<std::mutex> lg(mtx);
+
+        attempt = 0;
+        ++successes;
+
+        for (Breaker &b : breakers) {
+            b.consecutive = 0;
+            b.probing = false;
+            b.state = BREAKER_CLOSED;
+        }
+    }
+
+    // 记录一次失败，返回本次失败后应等待的时间
+    duration_type on_failure(int state, int error) {
+        std::lock_guard<std::mutex> lg(mtx);
+        Breaker &b = breakers[classify(state, error)];
+        auto now = clock_type::now();
+        duration_type delay = next_delay();
+        duration_type open_time = jittered_open_time();
+
+        ++b.failures;
+        ++b.consecutive;
+
+        bool trip = (b.state == BREAKER_CLOSED && b.consecutive >= opt.failure_threshold);
+
+        // 探测请求失败时，无论错误类别是否相同，所有半开的熔断器都重新打开
+        for (Breaker &x : breakers) {
+            if (x.state == BREAKER_HALF_OPEN || (trip && &x == &b)) {
+                ++x.opens;
+                x.state = BREAKER_OPEN;
+                x.probing = false;
+                x.open_until = now + open_time;
+                delay = std::max(delay, open_time);
+            }
+        }
+
+        return delay;
+    }
+
+    // 以Prometheus文本格式输出各熔断器的状态和计数
+    std::string metrics() const {
+        std::lock_guard<std::mutex> lg(mtx);
+        std::string str;
+
+        for (int i = 0; i < ERROR_CLASS_MAX; i++) {
+            const Breaker &b = breakers[i];
+            auto label = std::format("{{client=\"{}\",class=\"{}\"}}", name, class_name(i));
+
+            str.append(std::format("kafka_breaker_state{} {}\n", label, (int)b.state));
+            str.append(std::format("kafka_breaker_failures_total{} {}\n", label, b.failures));
+            str.append(std::format("kafka_breaker_opens_total{} {}\n", label, b.opens));
+        }
+
+        auto label = std::format("{{client=\"{}\"}}", name);
+        str.append(std::format("kafka_retry_successes_total{} {}\n", label, successes));
+        str.append(std::format("kafka_retry_rejected_total{} {}\n", label, rejected));
+
+        return str;
+    }
+
+private:
+    struct Breaker {
+        BreakerState state{BREAKER_CLOSED};
+        bool probing{false};
+        int consecutive{0};
+        long long failures{0};
+        long long opens{0};
+        clock_type::time_point open_until;
+    };
+
+    // 带抖动的指数退避，等待时间在[d/2, d]内均匀分布，d随连续失败次数指数增长
+    duration_type next_delay() {
+        double base = (double)opt.base_delay.count();
+        double cap = (double)opt.max_delay.count();
+        double d = std::min(cap, base * std::pow(opt.multiplier, attempt));
+
+        if (attempt < 64)
+            ++attempt;
+
+        std::uniform_real_distribution<double> dist(d / 2, d);
+        return duration_type((long long)dist(rng));
+    }
+
+    // 熔断器打开的时长同样带有抖动，在[open_time/2, open_time]内均匀分布
+    duration_type jittered_open_time() {
+        double t = (double)opt.open_time.count();
+
+        std::uniform_real_distribution<double> dist(t / 2, t);
+        return duration_type((long long)dist(rng));
+    }
+
+private:
+    std::string name;
+    RetryOptions opt;
+
+    mutable std::mutex mtx;
+    std::mt19937_64 rng;
+    int attempt{0};
+    long long successes{0};
+    long long rejected{0};
+    Breaker breakers[ERROR_CLASS_MAX];
+};
+
+#endif // KAFKA_EXAMPLE_RETRY_POLICY_H
@@ -1,9 +1,14 @@
 #ifndef KAFKA_EXAMPLE_TOPIC_MANAGER_H
 #define KAFKA_EXAMPLE_TOPIC_MANAGER_H
 
+#include <filesystem>
 #include <fstream>
 #include <string>
 #include <map>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 class TopicManager {
 public:
@@ -39,16 +44,36 @@ public:
         return ifs.eof();
     }
 
+    /**
+     * 先写入临时文件并fsync，再rename替换offset文件，最后fsync所在目录。中途崩溃时
+     * 保留的是上一次完整的offset文件，不会读到写了一半的内容。
+    */
     bool dump(const std::string &offset_file) {
-        std::ofstream ofs(offset_file);
+        std::string tmp = offset_file + ".tmp";
+        std::error_code ec;
+
+        {
+            std::ofstream ofs(tmp, std::ios::trunc);
+            if (!ofs.good())
+                return false;
+
+            for (auto &[tp, off] : m)
+                ofs << tp.topic << ' ' << tp.partition << ' ' << off << '\n';
 
-        if (!ofs.good())
+            ofs.flush();
+            if (!ofs.good())
+                return false;
+        }
+
+        if (!fsync_path(tmp, O_RDONLY))
             return false;
 
-        for (auto &[tp, off] : m)
-            ofs << tp.topic << ' ' << tp.partition << ' ' << off << std::endl;
+        std::filesystem::rename(tmp, offset_file, ec);
+        if (ec)
+            return false;
 
-        return ofs.good();
+        std::string dir = std::filesystem::path(offset_file).parent_path().string();
+        return fsync_path(dir.empty() ? "." : dir, O_RDONLY | O_DIRECTORY);
     }
 
     bool update(const std::string &topic, int partition, long long offset) {
@@ -83,6 +108,17 @@ public:
         return m.size();
     }
 
+private:
+    static bool fsync_path(const std::string &path, int flags) {
+        int fd = ::open(path.c_str(), flags);
+        if (fd < 0)
+            return false;
+
+        int ret = fsync(fd);
+        ::close(fd);
+        return ret == 0;
+    }
+
 private:
     OffsetMap m;
 };
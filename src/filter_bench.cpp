@@ -0,0 +1,133 @@
+#include <chrono>
+#include <format>
+#include <random>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "record_filter.h"
+
+#include "coke/tools/option_parser.h"
+
+std::string filter_spec = "json:type=\"purchase\"";
+int size_mb = 256;
+int record_size = 512;
+int rounds = 5;
+int match_permille = 10;
+
+struct Span {
+    std::size_t pos;
+    std::size_t len;
+};
+
+/**
+ * 生成形如{"id":1,"type":"view","user":"u123","payload":"..."}的数据，其中约
+ * match_permille/1000的记录type为purchase，其余数据用随机可见字符填充到record_size。
+*/
+void generate(std::string &buf, std::vector<Span> &spans) {
+    std::mt19937_64 rng(12345);
+    std::uniform_int_distribution<int> ch('a', 'z');
+    std::uniform_int_distribution<int> permille(0, 999);
+    std::size_t total = (std::size_t)size_mb * 1024 * 1024;
+
+    buf.reserve(total + record_size);
+
+    for (long long id = 0; buf.size() < total; id++) {
+        const char *type = permille(rng) < match_permille ? "purchase" : "view";
+        std::string rec = std::format("{{\"id\":{},\"type\":\"{}\",\"user\":\"u{}\",\"payload\":\"",
+                                      id, type, id % 100000);
+
+        while ((int)rec.size() < record_size - 2)
+            rec.push_back((char)ch(rng));
+
+        rec.append("\"}");
+        spans.push_back(Span{buf.size(), rec.size()});
+        buf.append(rec);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    coke::OptionParser args;
+
+    args.add_string(filter_spec, 'f', "filter", false)
+        .set_default("json:type=\"purchase\"")
+        .set_description("Filter to benchmark, only value clauses are evaluated.");
+
+    args.add_integer(size_mb, 's', "size-mb", false)
+        .set_default(256)
+        .set_description("Total MB of generated records.");
+
+    args.add_integer(record_size, 0, "record-size", false)
+        .set_default(512)
+        .set_description("Bytes of each generated record.");
+
+    args.add_integer(match_permille, 0, "match-permille", false)
+        .set_default(10)
+        .set_description("Permille of records whose type is purchase.");
+
+    args.add_integer(rounds, 'r', "rounds", false)
+        .set_default(5)
+        .set_description("Times to scan all records for each implementation.");
+
+    args.set_help_flag('h', "help");
+
+    std::string err;
+    int ret = args.parse(argc, argv, err);
+
+    if (ret < 0) {
+        std::cerr << err << std::endl;
+        return 1;
+    }
+    else if (ret > 0) {
+        args.usage(std::cout);
+        return 0;
+    }
+
+    if (size_mb <= 0 || record_size < 64 || rounds <= 0) {
+        std::cerr << "Invalid arguments" << std::endl;
+        return 1;
+    }
+
+    RecordFilter filter;
+    if (!filter.parse(filter_spec)) {
+        std::cerr << "Invalid filter " << filter_spec << std::endl;
+        return 1;
+    }
+
+    std::string buf;
+    std::vector<Span> spans;
+    generate(buf, spans);
+
+    std::cout << std::format("records:{} bytes:{}\n", spans.size(), buf.size());
+
+    const std::pair<ScanImpl, const char *> impls[] = {
+        {ScanImpl::SCALAR, "scalar"},
+        {ScanImpl::SSE2, "sse2"},
+        {ScanImpl::AVX2, "avx2"},
+    };
+
+    for (const auto &[impl, name] : impls) {
+        if (!scan_impl_supported(impl)) {
+            std::cout << std::format("{:>8} not supported\n", name);
+            continue;
+        }
+
+        filter.set_scan_impl(impl);
+
+        std::size_t kept = 0;
+        auto start = std::chrono::steady_clock::now();
+
+        for (int r = 0; r < rounds; r++) {
+            kept = 0;
+            for (const Span &sp : spans)
+                kept += filter.match_value(buf.data() + sp.pos, sp.len);
+        }
+
+        std::chrono::duration<double> cost = std::chrono::steady_clock::now() - start;
+        double gbps = (double)buf.size() * rounds / cost.count() / 1e9;
+
+        std::cout << std::format("{:>8} kept:{} throughput:{:.2f} GB/s\n", name, kept, gbps);
+    }
+
+    return 0;
+}
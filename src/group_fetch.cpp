@@ -1,9 +1,16 @@
 #include <atomic>
 #include <csignal>
+#include <memory>
 #include <string>
 #include <iostream>
 
+#include "chunking.h"
+#include "global_settings.h"
 #include "kafka_awaiter.h"
+#include "metrics_reporter.h"
+#include "record_filter.h"
+#include "record_store.h"
+#include "retry_policy.h"
 #include "show_result.h"
 
 #include "coke/sleep.h"
@@ -18,8 +25,16 @@ std::atomic<bool> running{true};
 std::string brokers;
 std::string topic;
 std::string group;
+std::string store_dir;
+std::string filter_spec;
 int retry_max = 0;
+int store_segment_mb = 256;
+int reassemble_mb = 0;
+int reassemble_timeout = 60;
 bool latest = false;
+ThreadSettings ts;
+MetricsSettings ms;
+RecordFilter filter;
 
 void sig_handler(int signo) {
     if (running.load() == false)
@@ -29,6 +44,12 @@ void sig_handler(int signo) {
     running.notify_all();
 }
 
+// 重组后的消息同样需要经过过滤
+void handle_chunked_message(const ChunkedMessage &msg) {
+    if (filter.match_message(msg.data, msg.size))
+        show_chunked_message(msg);
+}
+
 WFKafkaTask *create_group_fetch_task(WFKafkaClient &cli) {
     std::string query;
     query.append("api=fetch&topic=").append(topic);
@@ -53,14 +74,24 @@ WFKafkaTask *create_group_fetch_task(WFKafkaClient &cli) {
     return task;
 }
 
-WFKafkaTask *create_commit_task(WFKafkaClient &cli, const vec_records_t &vec_records) {
+WFKafkaTask *create_commit_task(WFKafkaClient &cli, const vec_records_t &vec_records,
+                               const ChunkReassembler *reasm)
+{
     WFKafkaTask *task = cli.create_kafka_task("api=commit", retry_max, nullptr);
     bool has_data = false;
 
     for (const auto &records : vec_records) {
-        if (!records.empty()) {
+        KafkaRecord *last = nullptr;
+
+        // 开启重组时，不能越过尚未完整的消息提交offset
+        if (reasm)
+            last = reasm->last_committable(records);
+        else if (!records.empty())
+            last = records.back();
+
+        if (last) {
             has_data = true;
-            task->add_commit_record(*records.back());
+            task->add_commit_record(*last);
         }
     }
 
@@ -72,7 +103,10 @@ WFKafkaTask *create_commit_task(WFKafkaClient &cli, const vec_records_t &vec_rec
     return task;
 }
 
-coke::Task<> group_fetch(WFKafkaClient &cli, coke::StopToken &tk) {
+coke::Task<> group_fetch(WFKafkaClient &cli, coke::StopToken &tk,
+                         RetryPolicy &policy, RecordStore *store,
+                         ChunkReassembler *reasm)
+{
     // 可以使用FinishGuard，在协程结束时自动调用tk.set_finished
     coke::StopToken::FinishGuard fg(&tk);
 
@@ -80,6 +114,13 @@ coke::Task<> group_fetch(WFKafkaClient &cli, coke::StopToken &tk) {
         int state, error;
         KafkaResult result;
 
+        // 熔断器打开期间不发起请求，等待到允许探测时再继续
+        auto wait = policy.before_request();
+        if (wait.count() > 0) {
+            co_await tk.wait_stop_for(wait);
+            continue;
+        }
+
         // 通过在一个代码块中将所需数据全部取出的方式，避免task的生命周期在下一个`co_await`
         // 处终止带来的额外负担。虽然不完美，但确实可以解决问题。
         {
@@ -97,31 +138,90 @@ coke::Task<> group_fetch(WFKafkaClient &cli, coke::StopToken &tk) {
             auto str = std::format("Fetch Failed state:{} error:{}", state, error);
             std::cout << str << std::endl;
 
-            // 拉取失败时可能服务端或网络故障，可以暂停一段时间。
-            co_await tk.wait_stop_for(std::chrono::seconds(1));
+            // 拉取失败时可能服务端或网络故障，按退避策略暂停一段时间。
+            auto delay = policy.on_failure(state, error);
+            std::cout << std::format("Retry after {}ms", delay.count()) << std::endl;
+            co_await tk.wait_stop_for(delay);
         }
         else {
             std::cout << "Fetch Success" << std::endl;
+            policy.on_success();
 
             std::vector<std::vector<KafkaRecord *>> vec_records;
             result.fetch_records(vec_records);
 
-            show_kafka_result(vec_records);
-
-            // group模式拉取到数据后需要手动提交offset，以便下次消费可以从上次结束的位置开始
-            WFKafkaTask *commit_task = create_commit_task(cli, vec_records);
-            if (commit_task) {
-                co_await KafkaAwaiter(commit_task);
-
-                state = commit_task->get_state();
-                if (state == WFT_STATE_SUCCESS)
-                    std::cout << "Commit Success" << std::endl;
+            // 重组缓冲区已满时，pos之后的记录暂不处理，等待未完成的消息完整或被放弃后
+            // 再继续。客户端内部已经越过了这些offset，因此只能暂停拉取，不能重新拉取
+            std::vector<std::size_t> pos;
+            bool done = false;
+            bool failed = false;
+
+            while (!done) {
+                // 过滤只决定哪些记录交给处理逻辑，被丢弃记录的offset仍需推进，
+                // 因此下面的commit继续使用过滤前的记录
+                vec_records_t plain_records, kept_records, fed_records;
+                const vec_records_t *records = &vec_records;
+                const vec_records_t *commit_records = &vec_records;
+
+                // chunk记录交给重组器，完整的消息直接处理，其余普通记录继续后面的流程
+                if (reasm) {
+                    done = reasm->feed(vec_records, pos, plain_records, handle_chunked_message);
+                    records_before(vec_records, pos, fed_records);
+                    records = &plain_records;
+                    commit_records = &fed_records;
+                }
                 else
-                    std::cout << "Commit Failed" << std::endl;
-            }
-            else {
-                std::cout << "No commit data" << std::endl;
+                    done = true;
+
+                if (!filter.empty()) {
+                    filter.filter(*records, kept_records);
+                    records = &kept_records;
+                }
+
+                show_kafka_result(*records);
+
+                // 开启本地存储时，只有数据持久化后才提交offset。客户端内部已经越过了这些
+                // offset，因此存储失败时只能停止消费，重启后从上次提交的位置继续
+                if (store && (!store->append(*records) || !store->flush())) {
+                    std::cout << "Store Failed, stop fetching" << std::endl;
+                    running.store(false);
+                    running.notify_all();
+                    failed = true;
+                    break;
+                }
+
+                // group模式拉取到数据后需要手动提交offset，以便下次消费可以从上次结束的位置开始
+                WFKafkaTask *commit_task = create_commit_task(cli, *commit_records, reasm);
+                if (commit_task) {
+                    co_await KafkaAwaiter(commit_task);
+
+                    state = commit_task->get_state();
+                    error = commit_task->get_error();
+                    if (state == WFT_STATE_SUCCESS)
+                        std::cout << "Commit Success" << std::endl;
+                    else {
+                        std::cout << "Commit Failed" << std::endl;
+
+                        // 未提交的offset会在下次提交时一并覆盖，这里只需退避
+                        co_await tk.wait_stop_for(policy.on_failure(state, error));
+                    }
+                }
+                else {
+                    std::cout << "No commit data" << std::endl;
+                }
+
+                if (!done) {
+                    std::cout << "Reassemble Buffer Full, waiting" << std::endl;
+                    co_await tk.wait_stop_for(std::chrono::seconds(1));
+
+                    // 未处理的记录没有提交，重启后会重新拉取
+                    if (tk.stop_requested())
+                        break;
+                }
             }
+
+            if (failed)
+                break;
         }
     }
 
@@ -156,6 +256,31 @@ int main(int argc, char *argv[]) {
         .set_default(false)
         .set_description("Use latest offset if no committed offset, default earlist");
 
+    args.add_string(store_dir, 0, "store-dir", false)
+        .set_description("Save fetched records to local segment files in this directory.");
+
+    args.add_integer(store_segment_mb, 0, "store-segment-mb", false)
+        .set_default(256)
+        .set_description("Size of each local segment file in MB.");
+
+    args.add_string(filter_spec, 0, "filter", false)
+        .set_description("Only process records matching this filter.")
+        .set_long_descriptions({
+            "Clauses separated by ';' must all match, each clause is one of",
+            "header:NAME=VALUE, key-prefix:PREFIX, contains:BYTES, json:FIELD=VALUE",
+        });
+
+    args.add_integer(reassemble_mb, 0, "reassemble-mb", false)
+        .set_default(0)
+        .set_description("Max memory in MB to reassemble chunked messages, 0 to disable.");
+
+    args.add_integer(reassemble_timeout, 0, "reassemble-timeout", false)
+        .set_default(60)
+        .set_description("Abandon incomplete messages receiving no chunk for this many seconds.");
+
+    add_thread_options(args, ts);
+    add_metrics_options(args, ms);
+
     args.set_help_flag('h', "help");
 
     std::string err;
@@ -170,6 +295,43 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    if (!filter.parse(filter_spec)) {
+        std::cerr << "Invalid filter " << filter_spec << std::endl;
+        return 1;
+    }
+
+    // 重组后的消息不是KafkaRecord，无法写入本地存储，两者同时开启会使这些消息缺失
+    if (reassemble_mb > 0 && !store_dir.empty()) {
+        std::cerr << "--reassemble-mb can not be used with --store-dir" << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<ChunkReassembler> reasm;
+    if (reassemble_mb > 0) {
+        std::size_t max_bytes = (std::size_t)reassemble_mb * 1024 * 1024;
+
+        // 缓冲区已满时依赖超时放弃未完成的消息才能继续，因此必须设置超时
+        if (reassemble_timeout <= 0) {
+            std::cerr << "Invalid reassemble timeout " << reassemble_timeout << std::endl;
+            return 1;
+        }
+
+        reasm = std::make_unique<ChunkReassembler>(max_bytes,
+                                                   std::chrono::seconds(reassemble_timeout));
+    }
+
+    std::unique_ptr<RecordStore> store;
+    if (!store_dir.empty()) {
+        std::size_t segment_bytes = (std::size_t)store_segment_mb * 1024 * 1024;
+
+        store = std::make_unique<RecordStore>();
+        if (store_segment_mb <= 0 || !store->open(store_dir, segment_bytes)) {
+            std::cerr << "Open store " << store_dir << " failed" << std::endl;
+            return 1;
+        }
+    }
+
+    apply_thread_settings(ts);
     signal(SIGINT, sig_handler);
 
     coke::StopToken tk;
@@ -177,7 +339,12 @@ int main(int argc, char *argv[]) {
     cli.init(brokers, group);
 
     // 启动并分离协程
-    coke::detach(group_fetch(cli, tk));
+    RetryPolicy policy("fetch");
+    MetricsReporter reporter(ms);
+    reporter.add(&policy);
+    reporter.start();
+
+    coke::detach(group_fetch(cli, tk, policy, store.get(), reasm.get()));
 
     // 等待并发送停止信号
     running.wait(true);
@@ -186,6 +353,8 @@ int main(int argc, char *argv[]) {
     // 等待后台协程完成，相当于join操作
     coke::sync_wait(tk.wait_finish());
 
+    reporter.stop();
+    std::cout << policy.metrics();
     cli.deinit();
     return 0;
 }
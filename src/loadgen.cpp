@@ -0,0 +1,509 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <format>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "global_settings.h"
+#include "kafka_awaiter.h"
+#include "latency_histogram.h"
+
+#include "coke/sleep.h"
+#include "coke/wait.h"
+#include "coke/tools/option_parser.h"
+
+using namespace protocol;
+using load_clock = std::chrono::steady_clock;
+
+std::atomic<bool> running{true};
+
+std::string brokers;
+std::string topic;
+std::string size_spec = "fixed:100";
+std::string key_spec = "none";
+double rate = 1000;
+int batch_size = 1;
+int duration = 60;
+int max_inflight = 10000;
+int report_interval = 1;
+int retry_max = 0;
+bool mock = false;
+int mock_service_us = 200;
+int mock_workers = 4;
+ThreadSettings ts;
+
+void sig_handler(int signo) {
+    if (running.load() == false)
+        abort();
+
+    running.store(false);
+}
+
+/**
+ * 开环压测：请求按固定速率排定发送时间，不等待前一个请求完成；延迟从排定的发送时间
+ * 开始计算，而不是从实际发出的时间。当客户端或broker处理不过来时，实际发送被推迟的
+ * 时间也会计入延迟，从而避免闭环压测中的coordinated omission问题。
+*/
+
+struct RecordSize {
+    int min_size;
+    int max_size;
+
+    bool parse(const std::string &spec) {
+        try {
+            if (spec.starts_with("fixed:")) {
+                min_size = max_size = std::stoi(spec.substr(6));
+                return min_size >= 0;
+            }
+
+            if (spec.starts_with("uniform:")) {
+                std::string range = spec.substr(8);
+                std::size_t dash = range.find('-');
+                if (dash == std::string::npos)
+                    return false;
+
+                min_size = std::stoi(range.substr(0, dash));
+                max_size = std::stoi(range.substr(dash + 1));
+                return min_size >= 0 && min_size <= max_size;
+            }
+        }
+        catch (...) { }
+
+        return false;
+    }
+
+    int next(std::mt19937_64 &rng) const {
+        if (min_size == max_size)
+            return min_size;
+
+        return std::uniform_int_distribution<int>(min_size, max_size)(rng);
+    }
+};
+
+/**
+ * key的分布，格式为
+ *     none          不设置key
+ *     seq:N         依次使用0到N-1
+ *     uniform:N     在[0, N)中均匀选择
+ *     zipf:N:S      在[0, N)中按参数为S的zipf分布选择，S越大热点越集中
+*/
+class KeyGenerator {
+public:
+    bool parse(const std::string &spec) {
+        try {
+            if (spec == "none") {
+                type = NONE;
+                return true;
+            }
+
+            std::size_t colon = spec.find(':');
+            if (colon == std::string::npos)
+                return false;
+
+            std::string kind = spec.substr(0, colon);
+            std::string arg = spec.substr(colon + 1);
+
+            if (kind == "seq" || kind == "uniform") {
+                type = (kind == "seq") ? SEQ : UNIFORM;
+                n = std::stoll(arg);
+                return n > 0;
+            }
+
+            if (kind == "zipf") {
+                std::size_t c2 = arg.find(':');
+                if (c2 == std::string::npos)
+                    return false;
+
+                type = ZIPF;
+                n = std::stoll(arg.substr(0, c2));
+                double s = std::stod(arg.substr(c2 + 1));
+                if (n <= 0 || n > 100000000 || s <= 0)
+                    return false;
+
+                build_zipf(s);
+                return true;
+            }
+        }
+        catch (...) { }
+
+        return false;
+    }
+
+    // 返回false表示不设置key
+    bool next(std::mt19937_64 &rng, std::string &key) {
+        long long k;
+
+        switch (type) {
+        case NONE:
+            return false;
+        case SEQ:
+            k = seq++ % n;
+            break;
+        case UNIFORM:
+            k = std::uniform_int_distribution<long long>(0, n - 1)(rng);
+            break;
+        case ZIPF:
+        default:
+            {
+                double u = std::uniform_real_distribution<double>(0, 1)(rng);
+                k = std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+                k = std::min(k, n - 1);
+            }
+            break;
+        }
+
+        key = std::format("key-{}", k);
+        return true;
+    }
+
+private:
+    void build_zipf(double s) {
+        double sum = 0;
+
+        cdf.resize(n);
+        for (long long i = 0; i < n; i++) {
+            sum += 1.0 / std::pow((double)(i + 1), s);
+            cdf[i] = sum;
+        }
+
+        for (double &c : cdf)
+            c /= sum;
+    }
+
+private:
+    enum { NONE, SEQ, UNIFORM, ZIPF } type{NONE};
+    long long n{0};
+    long long seq{0};
+    std::vector<double> cdf;
+};
+
+/**
+ * 进程内的模拟broker，由mock_workers个串行处理请求的工作者组成，每个请求的处理时间为
+ * mock_service_us乘以请求中的记录数。请求在所有工作者都忙碌时排队，因此当发送速率
+ * 超过其处理能力时，可以观察到排队延迟的增长。
+*/
+class MockBroker {
+public:
+    MockBroker(int workers, int service_us)
+        : free_at(workers, load_clock::now()), service(service_us)
+    { }
+
+    // 返回该请求的完成时间
+    load_clock::time_point submit(int records) {
+        std::lock_guard<std::mutex> lg(mtx);
+        auto now = load_clock::now();
+        auto it = std::min_element(free_at.begin(), free_at.end());
+
+        *it = std::max(*it, now) + service * records;
+        return *it;
+    }
+
+private:
+    std::mutex mtx;
+    std::vector<load_clock::time_point> free_at;
+    std::chrono::microseconds service;
+};
+
+/**
+ * 失败的请求同样计入total和interval，否则过载时超时的请求会从分位数中消失，低估尾部
+ * 延迟；failed单独记录失败请求的延迟，便于区分慢请求和失败请求。
+*/
+struct LoadStats {
+    std::mutex mtx;
+    LatencyHistogram total;
+    LatencyHistogram interval;
+    LatencyHistogram failed;
+    long long interval_records{0};
+    long long interval_bytes{0};
+    long long interval_errors{0};
+    long long total_records{0};
+    long long total_bytes{0};
+    long long total_errors{0};
+
+    void add(load_clock::time_point intended, bool ok, int records, long long bytes) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+            load_clock::now() - intended).count();
+        std::lock_guard<std::mutex> lg(mtx);
+
+        total.record(us);
+        interval.record(us);
+
+        if (ok) {
+            interval_records += records;
+            interval_bytes += bytes;
+            total_records += records;
+            total_bytes += bytes;
+        }
+        else {
+            failed.record(us);
+            ++interval_errors;
+            ++total_errors;
+        }
+    }
+};
+
+struct Request {
+    WFKafkaTask *task;
+    load_clock::time_point intended;
+    int records;
+    long long bytes;
+};
+
+WFKafkaTask *create_produce_task(WFKafkaClient &cli) {
+    std::string query("api=produce");
+    auto *task = cli.create_kafka_task(query, retry_max, nullptr);
+
+    KafkaConfig cfg;
+    cfg.set_produce_timeout(1000);
+    task->set_config(cfg);
+
+    return task;
+}
+
+coke::Task<> send_request(Request req, LoadStats &stats, std::atomic<int> &inflight) {
+    co_await KafkaAwaiter(req.task);
+
+    bool ok = (req.task->get_state() == WFT_STATE_SUCCESS);
+    stats.add(req.intended, ok, req.records, req.bytes);
+    inflight.fetch_sub(1);
+}
+
+coke::Task<> send_mock_request(MockBroker &broker, Request req, LoadStats &stats,
+                               std::atomic<int> &inflight)
+{
+    auto done = broker.submit(req.records);
+    std::chrono::duration<double> wait = done - load_clock::now();
+
+    if (wait.count() > 0)
+        co_await coke::sleep(wait.count());
+
+    stats.add(req.intended, true, req.records, req.bytes);
+    inflight.fetch_sub(1);
+}
+
+coke::Task<> report(LoadStats &stats, std::atomic<bool> &finished) {
+    auto start = load_clock::now();
+
+    std::cout << std::format("{:>6} {:>12} {:>10} {:>8} {:>10} {:>10} {:>10} {:>10}\n",
+                             "time", "records/s", "MB/s", "errors",
+                             "p50(us)", "p99(us)", "p99.9(us)", "max(us)");
+
+    while (!finished.load()) {
+        co_await coke::sleep((double)report_interval);
+
+        std::lock_guard<std::mutex> lg(stats.mtx);
+        double sec = std::chrono::duration<double>(load_clock::now() - start).count();
+        const LatencyHistogram &h = stats.interval;
+
+        std::cout << std::format("{:>6.0f} {:>12.0f} {:>10.2f} {:>8} {:>10} {:>10} {:>10} {:>10}\n",
+                                 sec, (double)stats.interval_records / report_interval,
+                                 stats.interval_bytes / 1048576.0 / report_interval,
+                                 stats.interval_errors, h.percentile(50), h.percentile(99),
+                                 h.percentile(99.9), h.max());
+
+        stats.interval.reset();
+        stats.interval_records = 0;
+        stats.interval_bytes = 0;
+        stats.interval_errors = 0;
+    }
+}
+
+coke::Task<> generate(WFKafkaClient *cli, MockBroker *broker, LoadStats &stats,
+                      std::atomic<bool> &finished)
+{
+    std::mt19937_64 rng(std::random_device{}());
+    RecordSize sizes;
+    KeyGenerator keys;
+
+    sizes.parse(size_spec);
+    keys.parse(key_spec);
+
+    std::string payload(sizes.max_size, '\0');
+    for (char &c : payload)
+        c = (char)('a' + rng() % 26);
+
+    std::atomic<int> inflight{0};
+    std::string key;
+    auto period = std::chrono::duration<double>(batch_size / rate);
+    auto start = load_clock::now();
+    auto end = start + std::chrono::seconds(duration);
+
+    for (long long i = 0; running.load(); i++) {
+        auto intended = start + std::chrono::duration_cast<load_clock::duration>(period * i);
+        if (intended >= end)
+            break;
+
+        // 落后于计划时不再等待，立即发送；延迟仍从intended开始计算
+        auto now = load_clock::now();
+        if (intended > now)
+            co_await coke::sleep(std::chrono::duration<double>(intended - now).count());
+
+        // 在途请求达到上限时推迟发送，推迟的时间同样计入延迟
+        while (inflight.load() >= max_inflight)
+            co_await coke::sleep(0.0001);
+
+        Request req{nullptr, intended, batch_size, 0};
+
+        if (cli) {
+            req.task = create_produce_task(*cli);
+
+            for (int j = 0; j < batch_size; j++) {
+                KafkaRecord r;
+                int size = sizes.next(rng);
+
+                if (keys.next(rng, key))
+                    r.set_key(key.data(), key.size());
+
+                r.set_value(payload.data(), size);
+                req.bytes += size;
+                req.task->add_produce_record(topic, -1, std::move(r));
+            }
+        }
+        else {
+            for (int j = 0; j < batch_size; j++)
+                req.bytes += sizes.next(rng);
+        }
+
+        inflight.fetch_add(1);
+
+        if (cli)
+            coke::detach(send_request(req, stats, inflight));
+        else
+            coke::detach(send_mock_request(*broker, req, stats, inflight));
+    }
+
+    // 等待所有在途请求完成
+    while (inflight.load() > 0)
+        co_await coke::sleep(0.01);
+
+    finished.store(true);
+}
+
+int main(int argc, char *argv[]) {
+    coke::OptionParser args;
+
+    args.add_string(brokers, 'b', "broker", false)
+        .set_description("The url of broker(s), like \"kafka://localhost:9092/\".");
+
+    args.add_string(topic, 't', "topic", false)
+        .set_description("The topic to produce to.");
+
+    args.add_flag(mock, 0, "mock")
+        .set_description("Send to an in-process mock broker instead of a real cluster.");
+
+    args.add_integer(mock_service_us, 0, "mock-service-us", false)
+        .set_default(200)
+        .set_description("Service time in microseconds of each record in mock broker.");
+
+    args.add_integer(mock_workers, 0, "mock-workers", false)
+        .set_default(4)
+        .set_description("Number of requests mock broker processes concurrently.");
+
+    args.add_floating(rate, 'r', "rate", false)
+        .set_default(1000)
+        .set_description("Target records per second.");
+
+    args.add_integer(batch_size, 0, "batch", false)
+        .set_default(1)
+        .set_description("Records in each produce request.");
+
+    args.add_integer(duration, 'd', "duration", false)
+        .set_default(60)
+        .set_description("Seconds to run.");
+
+    args.add_string(size_spec, 's', "record-size", false)
+        .set_default("fixed:100")
+        .set_description("Value size distribution, fixed:N or uniform:MIN-MAX.");
+
+    args.add_string(key_spec, 'k', "key", false)
+        .set_default("none")
+        .set_description("Key distribution, none, seq:N, uniform:N or zipf:N:S.");
+
+    args.add_integer(max_inflight, 0, "max-inflight", false)
+        .set_default(10000)
+        .set_description("Max outstanding requests, late sends still count from schedule.");
+
+    args.add_integer(report_interval, 'i', "interval", false)
+        .set_default(1)
+        .set_description("Seconds between throughput and latency reports.");
+
+    args.add_integer(retry_max, 0, "retry", false)
+        .set_default(0)
+        .set_description("Max retry for each task.");
+
+    add_thread_options(args, ts);
+
+    args.set_help_flag('h', "help");
+
+    std::string err;
+    int ret = args.parse(argc, argv, err);
+
+    if (ret < 0) {
+        std::cerr << err << std::endl;
+        return 1;
+    }
+    else if (ret > 0) {
+        args.usage(std::cout);
+        return 0;
+    }
+
+    if (!mock && (brokers.empty() || topic.empty())) {
+        std::cerr << "--broker and --topic are required without --mock" << std::endl;
+        return 1;
+    }
+
+    RecordSize sizes;
+    KeyGenerator keys;
+    if (!sizes.parse(size_spec) || !keys.parse(key_spec)) {
+        std::cerr << "Invalid record size or key distribution" << std::endl;
+        return 1;
+    }
+
+    if (rate <= 0 || batch_size <= 0 || duration <= 0 || max_inflight <= 0 ||
+        report_interval <= 0 || mock_service_us < 0 || mock_workers <= 0)
+    {
+        std::cerr << "Invalid arguments" << std::endl;
+        return 1;
+    }
+
+    apply_thread_settings(ts);
+    signal(SIGINT, sig_handler);
+
+    WFKafkaClient cli;
+    MockBroker broker(mock_workers, mock_service_us);
+    LoadStats stats;
+    std::atomic<bool> finished{false};
+
+    if (!mock)
+        cli.init(brokers);
+
+    coke::sync_wait(
+        generate(mock ? nullptr : &cli, &broker, stats, finished),
+        report(stats, finished)
+    );
+
+    const LatencyHistogram &h = stats.total;
+    std::cout << std::format("\nrecords:{} bytes:{} errors:{} mean:{:.1f}us\n",
+                             stats.total_records, stats.total_bytes, stats.total_errors,
+                             h.mean());
+
+    for (double p : {50.0, 75.0, 90.0, 99.0, 99.9, 99.99, 100.0})
+        std::cout << std::format("p{:<6} {:>12} us\n", p, h.percentile(p));
+
+    const LatencyHistogram &f = stats.failed;
+    if (f.count() > 0) {
+        std::cout << std::format("failed p50:{}us p99:{}us max:{}us\n",
+                                 f.percentile(50), f.percentile(99), f.max());
+    }
+
+    if (!mock)
+        cli.deinit();
+
+    return 0;
+}
@@ -1,9 +1,16 @@
 #include <atomic>
 #include <csignal>
+#include <memory>
 #include <string>
 #include <iostream>
 
+#include "chunking.h"
+#include "global_settings.h"
 #include "kafka_awaiter.h"
+#include "metrics_reporter.h"
+#include "record_filter.h"
+#include "record_store.h"
+#include "retry_policy.h"
 #include "show_result.h"
 #include "topic_manager.h"
 
@@ -18,9 +25,17 @@ std::atomic<bool> running{true};
 
 std::string offset_file;
 std::string brokers;
+std::string store_dir;
+std::string filter_spec;
 int retry_max = 0;
+int store_segment_mb = 256;
+int reassemble_mb = 0;
+int reassemble_timeout = 60;
 bool latest = false;
 long long offset_timestamp = -1;
+ThreadSettings ts;
+MetricsSettings ms;
+RecordFilter filter;
 
 void sig_handler(int signo) {
     if (running.load() == false)
@@ -30,6 +45,12 @@ void sig_handler(int signo) {
     running.notify_all();
 }
 
+// 重组后的消息同样需要经过过滤
+void handle_chunked_message(const ChunkedMessage &msg) {
+    if (filter.match_message(msg.data, msg.size))
+        show_chunked_message(msg);
+}
+
 WFKafkaTask *create_manual_fetch_task(WFKafkaClient &cli) {
     std::string query("api=fetch");
 
@@ -82,8 +103,29 @@ void update_toppars(const vec_records_t &vec_records, TopicManager &m) {
     }
 }
 
+/**
+ * 保存偏移量。开启重组时，m中维护的是下一次拉取的位置，已经越过了尚未完整的消息，
+ * 保存时需要退回到最早的未完成消息的起始位置，重启后重新拉取这些chunk。
+*/
+bool dump_offsets(const TopicManager &m, const std::string &offset_file,
+                  const ChunkReassembler *reasm)
+{
+    TopicManager snapshot = m;
+
+    if (reasm) {
+        snapshot.for_each([reasm](const std::string &topic, int par, long long &off) {
+            long long first = reasm->first_pending_offset(topic, par);
+            if (first >= 0 && first < off)
+                off = first;
+        });
+    }
+
+    return snapshot.dump(offset_file);
+}
+
 coke::Task<> manual_fetch(WFKafkaClient &cli, coke::StopToken &tk,
-                          const std::string &offset_file)
+                          const std::string &offset_file, RetryPolicy &policy,
+                          RecordStore *store, ChunkReassembler *reasm)
 {
     // 可以使用FinishGuard，在协程结束时自动调用tk.set_finished
     coke::StopToken::FinishGuard fg(&tk);
@@ -102,6 +144,13 @@ coke::Task<> manual_fetch(WFKafkaClient &cli, coke::StopToken &tk,
     }
 
     while (!tk.stop_requested()) {
+        // 熔断器打开期间不发起请求，等待到允许探测时再继续
+        auto wait = policy.before_request();
+        if (wait.count() > 0) {
+            co_await tk.wait_stop_for(wait);
+            continue;
+        }
+
         WFKafkaTask *task = create_manual_fetch_task(cli);
 
         // 手动模式下需要自行维护和设置topic对应的偏移量
@@ -123,23 +172,67 @@ coke::Task<> manual_fetch(WFKafkaClient &cli, coke::StopToken &tk,
             auto str = std::format("Fetch Failed state:{} error:{}", state, error);
             std::cout << str << std::endl;
 
-            // 拉取失败时可能服务端或网络故障，可以暂停一段时间。
-            co_await tk.wait_stop_for(std::chrono::seconds(1));
+            // 拉取失败时可能服务端或网络故障，按退避策略暂停一段时间。
+            auto delay = policy.on_failure(state, error);
+            std::cout << std::format("Retry after {}ms", delay.count()) << std::endl;
+            co_await tk.wait_stop_for(delay);
         }
         else {
             std::cout << "Fetch Success" << std::endl;
+            policy.on_success();
 
             std::vector<std::vector<KafkaRecord *>> vec_records;
             result.fetch_records(vec_records);
 
-            show_kafka_result(vec_records);
+            // 过滤只决定哪些记录交给处理逻辑，被丢弃记录的offset仍需推进，
+            // 因此下面的update_toppars继续使用过滤前的记录
+            vec_records_t plain_records, kept_records, fed_records;
+            const vec_records_t *records = &vec_records;
+            const vec_records_t *update_records = &vec_records;
+            bool done = true;
+
+            // chunk记录交给重组器，完整的消息直接处理，其余普通记录继续后面的流程。
+            // 重组缓冲区已满时，pos之后的记录暂不处理，偏移量只推进到pos处，下次从这里
+            // 重新拉取
+            if (reasm) {
+                std::vector<std::size_t> pos;
+
+                done = reasm->feed(vec_records, pos, plain_records, handle_chunked_message);
+                records_before(vec_records, pos, fed_records);
+                records = &plain_records;
+                update_records = &fed_records;
+            }
+
+            if (!filter.empty()) {
+                filter.filter(*records, kept_records);
+                records = &kept_records;
+            }
+
+            show_kafka_result(*records);
+
+            // 开启本地存储时，只有数据持久化后才推进偏移量，否则下次仍从原位置拉取
+            if (store && (!store->append(*records) || !store->flush())) {
+                std::cout << "Store Failed" << std::endl;
+                co_await tk.wait_stop_for(std::chrono::seconds(1));
+                continue;
+            }
 
             // 拉取成功时维护新的偏移量
-            update_toppars(vec_records, m);
+            update_toppars(*update_records, m);
+
+            // 数据已持久化，同时将偏移量保存到offset文件作为检查点
+            if (store && !dump_offsets(m, offset_file, reasm))
+                std::cout << "Checkpoint Failed" << std::endl;
+
+            // 等待未完成的消息完整或被放弃后再重新拉取剩余的记录
+            if (!done) {
+                std::cout << "Reassemble Buffer Full, waiting" << std::endl;
+                co_await tk.wait_stop_for(std::chrono::seconds(1));
+            }
         }
     }
 
-    flag = m.dump(offset_file);
+    flag = dump_offsets(m, offset_file, reasm);
     if (!flag)
         std::cerr << "Dump offset to " << offset_file << " failed" << std::endl;
 }
@@ -170,6 +263,31 @@ int main(int argc, char *argv[]) {
     args.add_flag(latest, 0, "latest")
         .set_description("Use latest offset if it is negative in offset file, default earlist");
 
+    args.add_string(store_dir, 0, "store-dir", false)
+        .set_description("Save fetched records to local segment files in this directory.");
+
+    args.add_integer(store_segment_mb, 0, "store-segment-mb", false)
+        .set_default(256)
+        .set_description("Size of each local segment file in MB.");
+
+    args.add_string(filter_spec, 0, "filter", false)
+        .set_description("Only process records matching this filter.")
+        .set_long_descriptions({
+            "Clauses separated by ';' must all match, each clause is one of",
+            "header:NAME=VALUE, key-prefix:PREFIX, contains:BYTES, json:FIELD=VALUE",
+        });
+
+    args.add_integer(reassemble_mb, 0, "reassemble-mb", false)
+        .set_default(0)
+        .set_description("Max memory in MB to reassemble chunked messages, 0 to disable.");
+
+    args.add_integer(reassemble_timeout, 0, "reassemble-timeout", false)
+        .set_default(60)
+        .set_description("Abandon incomplete messages receiving no chunk for this many seconds.");
+
+    add_thread_options(args, ts);
+    add_metrics_options(args, ms);
+
     args.set_help_flag('h', "help");
 
     std::string err;
@@ -184,6 +302,43 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    if (!filter.parse(filter_spec)) {
+        std::cerr << "Invalid filter " << filter_spec << std::endl;
+        return 1;
+    }
+
+    // 重组后的消息不是KafkaRecord，无法写入本地存储，两者同时开启会使这些消息缺失
+    if (reassemble_mb > 0 && !store_dir.empty()) {
+        std::cerr << "--reassemble-mb can not be used with --store-dir" << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<ChunkReassembler> reasm;
+    if (reassemble_mb > 0) {
+        std::size_t max_bytes = (std::size_t)reassemble_mb * 1024 * 1024;
+
+        // 缓冲区已满时依赖超时放弃未完成的消息才能继续，因此必须设置超时
+        if (reassemble_timeout <= 0) {
+            std::cerr << "Invalid reassemble timeout " << reassemble_timeout << std::endl;
+            return 1;
+        }
+
+        reasm = std::make_unique<ChunkReassembler>(max_bytes,
+                                                   std::chrono::seconds(reassemble_timeout));
+    }
+
+    std::unique_ptr<RecordStore> store;
+    if (!store_dir.empty()) {
+        std::size_t segment_bytes = (std::size_t)store_segment_mb * 1024 * 1024;
+
+        store = std::make_unique<RecordStore>();
+        if (store_segment_mb <= 0 || !store->open(store_dir, segment_bytes)) {
+            std::cerr << "Open store " << store_dir << " failed" << std::endl;
+            return 1;
+        }
+    }
+
+    apply_thread_settings(ts);
     signal(SIGINT, sig_handler);
 
     coke::StopToken tk;
@@ -191,7 +346,12 @@ int main(int argc, char *argv[]) {
     cli.init(brokers);
 
     // 启动并分离协程
-    coke::detach(manual_fetch(cli, tk, offset_file));
+    RetryPolicy policy("fetch");
+    MetricsReporter reporter(ms);
+    reporter.add(&policy);
+    reporter.start();
+
+    coke::detach(manual_fetch(cli, tk, offset_file, policy, store.get(), reasm.get()));
 
     // 等待并发送停止信号
     running.wait(true);
@@ -200,6 +360,8 @@ int main(int argc, char *argv[]) {
     // 等待后台协程完成，相当于join操作
     coke::sync_wait(tk.wait_finish());
 
+    reporter.stop();
+    std::cout << policy.metrics();
     cli.deinit();
     return 0;
 }
@@ -0,0 +1,561 @@
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <deque>
+#include <format>
+#include <map>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "global_settings.h"
+#include "kafka_awaiter.h"
+#include "metrics_reporter.h"
+#include "retry_policy.h"
+#include "show_result.h"
+
+#include "coke/sleep.h"
+#include "coke/wait.h"
+#include "coke/stop_token.h"
+#include "coke/tools/option_parser.h"
+
+using namespace protocol;
+
+std::atomic<bool> running{true};
+
+std::string src_brokers;
+std::string dst_brokers;
+std::string topic;
+std::string target_topic;
+std::string group;
+std::string partition_map_str;
+int retry_max = 0;
+bool latest = false;
+ThreadSettings ts;
+MetricsSettings ms;
+
+// 源partition到目标partition的映射，-1表示由目标端的partitioner决定
+std::map<int, int> partition_map;
+int default_partition = -2;
+
+void sig_handler(int signo) {
+    if (running.load() == false)
+        abort();
+
+    running.store(false);
+    running.notify_all();
+}
+
+/**
+ * 解析形如"0:1,1:-1,*:-1"的映射规则，`*`用于指定未列出的partition的默认规则。
+ * 未指定默认规则时，数据会被写入目标topic中与源相同编号的partition。
+*/
+bool parse_partition_map(const std::string &str) {
+    std::size_t pos = 0;
+
+    while (pos < str.size()) {
+        std::size_t end = str.find(',', pos);
+        if (end == std::string::npos)
+            end = str.size();
+
+        std::string item = str.substr(pos, end - pos);
+        std::size_t colon = item.find(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == item.size())
+            return false;
+
+        try {
+            std::string src = item.substr(0, colon);
+            int dst = std::stoi(item.substr(colon + 1));
+
+            if (dst < -1)
+                return false;
+
+            if (src == "*")
+                default_partition = dst;
+            else
+                partition_map[std::stoi(src)] = dst;
+        }
+        catch (...) {
+            return false;
+        }
+
+        pos = end + 1;
+    }
+
+    return true;
+}
+
+int map_partition(int partition) {
+    auto it = partition_map.find(partition);
+    if (it != partition_map.end())
+        return it->second;
+
+    return default_partition == -2 ? partition : default_partition;
+}
+
+WFKafkaTask *create_group_fetch_task(WFKafkaClient &cli) {
+    std::string query;
+    query.append("api=fetch&topic=").append(topic);
+
+    auto *task = cli.create_kafka_task(query, retry_max, nullptr);
+    long long t = latest ? KAFKA_TIMESTAMP_LATEST : KAFKA_TIMESTAMP_EARLIEST;
+    KafkaConfig config;
+
+    config.set_offset_timestamp(t);
+    config.set_fetch_timeout(1000);
+
+    // 跨机房复制时单批次越大，往返次数越少
+    config.set_fetch_max_bytes(1024 * 1024);
+
+    task->set_config(std::move(config));
+
+    return task;
+}
+
+WFKafkaTask *create_commit_task(WFKafkaClient &cli, const vec_records_t &vec_records) {
+    WFKafkaTask *task = cli.create_kafka_task("api=commit", retry_max, nullptr);
+    bool has_data = false;
+
+    for (const auto &records : vec_records) {
+        if (!records.empty()) {
+            has_data = true;
+            task->add_commit_record(*records.back());
+        }
+    }
+
+    if (!has_data) {
+        task->dismiss();
+        task = nullptr;
+    }
+
+    return task;
+}
+
+WFKafkaTask *create_produce_task(WFKafkaClient &cli) {
+    std::string query("api=produce");
+    auto *task = cli.create_kafka_task(query, retry_max, nullptr);
+
+    KafkaConfig cfg;
+    cfg.set_produce_timeout(1000);
+    task->set_config(cfg);
+
+    return task;
+}
+
+WFKafkaTask *create_refetch_task(WFKafkaClient &cli) {
+    auto *task = cli.create_kafka_task("api=fetch", retry_max, nullptr);
+    KafkaConfig config;
+
+    config.set_fetch_timeout(1000);
+    config.set_fetch_max_bytes(1024 * 1024);
+    config.set_offset_timestamp(KAFKA_TIMESTAMP_EARLIEST);
+
+    task->set_config(std::move(config));
+
+    return task;
+}
+
+/**
+ * 一个批次的全部状态。vec_records中的指针指向results内部，因此批次一旦拉取完成就不再
+ * 移动，两个批次对象交替使用，一个在写入目标端的同时另一个从源端拉取。重新拉取时
+ * 一个批次可能由多次拉取的结果组成。
+*/
+struct MirrorBatch {
+    int state = WFT_STATE_UNDEFINED;
+    int error = 0;
+    RetryPolicy::duration_type wait{0};
+    std::deque<KafkaResult> results;
+    vec_records_t vec_records;
+
+    void reset() {
+        state = WFT_STATE_UNDEFINED;
+        error = 0;
+        wait = RetryPolicy::duration_type(0);
+        vec_records.clear();
+        results.clear();
+    }
+
+    bool empty() const {
+        for (const auto &records : vec_records) {
+            if (!records.empty())
+                return false;
+        }
+
+        return true;
+    }
+};
+
+// 批次中一个partition的offset范围，写入失败后据此从源端重新拉取
+struct BatchRange {
+    std::string topic;
+    int partition;
+    long long first;
+    long long last;
+    long long next;
+};
+
+std::vector<BatchRange> batch_ranges(const vec_records_t &vec_records) {
+    std::vector<BatchRange> ranges;
+
+    for (const auto &records : vec_records) {
+        if (records.empty())
+            continue;
+
+        const KafkaRecord *front = records.front();
+        ranges.push_back(BatchRange{front->get_topic(), front->get_partition(),
+                                    front->get_offset(), records.back()->get_offset(), 0});
+    }
+
+    return ranges;
+}
+
+coke::Task<> fetch_batch(WFKafkaClient &cli, MirrorBatch &batch, RetryPolicy &policy) {
+    // 源端熔断时不发起请求，批次保持失败状态并带回需要等待的时间
+    batch.wait = policy.before_request();
+    if (batch.wait.count() > 0)
+        co_return;
+
+    WFKafkaTask *task = create_group_fetch_task(cli);
+    co_await KafkaAwaiter(task);
+
+    batch.state = task->get_state();
+    batch.error = task->get_error();
+
+    if (batch.state == WFT_STATE_SUCCESS) {
+        policy.on_success();
+        batch.results.push_back(std::move(*(task->get_result())));
+        batch.results.back().fetch_records(batch.vec_records);
+    }
+    else
+        batch.wait = policy.on_failure(batch.state, batch.error);
+}
+
+/**
+ * 批次中的记录已经移交给失败的生产任务，通过不属于消费组的客户端按offset重新拉取
+ * 这些范围内的记录，拉取到的范围之外的记录被丢弃。返回false表示收到了停止信号。
+*/
+coke::Task<bool> refetch_batch(WFKafkaClient &cli, std::vector<BatchRange> &ranges,
+                               MirrorBatch &batch, RetryPolicy &policy, coke::StopToken &tk)
+{
+    batch.reset();
+    for (BatchRange &r : ranges)
+        r.next = r.first;
+
+    while (!tk.stop_requested()) {
+        auto wait = policy.before_request();
+        if (wait.count() > 0) {
+            co_await tk.wait_stop_for(wait);
+            continue;
+        }
+
+        WFKafkaTask *task = nullptr;
+        for (const BatchRange &r : ranges) {
+            if (r.next > r.last)
+                continue;
+
+            if (!task)
+                task = create_refetch_task(cli);
+
+            KafkaToppar tp;
+            tp.set_topic_partition(r.topic, r.partition);
+            tp.set_offset(r.next);
+            task->add_toppar(tp);
+        }
+
+        if (!task)
+            co_return true;
+
+        co_await KafkaAwaiter(task);
+
+        int state = task->get_state();
+        int error = task->get_error();
+
+        if (state != WFT_STATE_SUCCESS) {
+            wait = policy.on_failure(state, error);
+
+            auto str = std::format("Refetch Failed state:{} error:{} retry after {}ms",
+                                   state, error, wait.count());
+            std::cout << str << std::endl;
+
+            co_await tk.wait_stop_for(wait);
+            continue;
+        }
+
+        policy.on_success();
+
+        vec_records_t vec_records;
+        std::size_t kept = 0;
+
+        batch.results.push_back(std::move(*(task->get_result())));
+        batch.results.back().fetch_records(vec_records);
+
+        for (auto &records : vec_records) {
+            std::vector<KafkaRecord *> in_range;
+
+            for (KafkaRecord *rec : records) {
+                for (BatchRange &r : ranges) {
+                    long long offset = rec->get_offset();
+
+                    if (r.partition != rec->get_partition() || r.topic != rec->get_topic() ||
+                        offset < r.next || offset > r.last)
+                        continue;
+
+                    in_range.push_back(rec);
+                    r.next = offset + 1;
+                    break;
+                }
+            }
+
+            kept += in_range.size();
+            batch.vec_records.push_back(std::move(in_range));
+        }
+
+        // 已不在源端的记录(例如被retention删除)无法再复制，放弃剩余的范围
+        if (kept == 0) {
+            for (BatchRange &r : ranges) {
+                if (r.next <= r.last) {
+                    auto str = std::format("Refetch lost topic:{} partition:{} offset:{}-{}",
+                                           r.topic, r.partition, r.next, r.last);
+                    std::cout << str << std::endl;
+                    r.next = r.last + 1;
+                }
+            }
+        }
+    }
+
+    co_return false;
+}
+
+/**
+ * 将批次写入目标端，写入成功后再提交源端offset。记录直接移动到生产任务中，key, value
+ * 和headers都不会被重新拷贝；写入失败时记录已随失败的任务释放，按dst_policy退避后
+ * 通过refetch从源端重新拉取同一批次再重试，直到成功或收到停止信号。ok为false表示
+ * 因停止而放弃了本批次，此时源端的offset未被提交，重启后会从上次提交的位置重新复制。
+*/
+coke::Task<> mirror_batch(WFKafkaClient &src, WFKafkaClient &refetch, WFKafkaClient &dst,
+                          MirrorBatch &batch, RetryPolicy &src_policy,
+                          RetryPolicy &dst_policy, coke::StopToken &tk, bool &ok)
+{
+    ok = true;
+    if (batch.empty())
+        co_return;
+
+    // commit任务和重新拉取的范围需要记录的topic, partition, offset，必须在数据被移走之前
+    // 创建；任务在启动前不会被销毁，因此可以跨越下面的`co_await`
+    WFKafkaTask *commit_task = create_commit_task(src, batch.vec_records);
+    std::vector<BatchRange> ranges = batch_ranges(batch.vec_records);
+    const std::string &dst_topic = target_topic.empty() ? topic : target_topic;
+    bool moved = false;
+    bool done = false;
+    std::size_t cnt = 0;
+
+    while (!tk.stop_requested()) {
+        // 目标端熔断或处于退避期间时等待
+        auto wait = dst_policy.before_request();
+        if (wait.count() > 0) {
+            co_await tk.wait_stop_for(wait);
+            continue;
+        }
+
+        // 上一次写入失败时记录已随失败的任务释放，先从源端重新拉取
+        if (moved && !co_await refetch_batch(refetch, ranges, batch, src_policy, tk))
+            break;
+
+        WFKafkaTask *task = create_produce_task(dst);
+        cnt = 0;
+
+        for (auto &records : batch.vec_records) {
+            for (KafkaRecord *rec : records) {
+                int partition = map_partition(rec->get_partition());
+
+                // 直接将拉取到的KafkaRecord移动到生产任务中，key, value和headers都不会
+                // 被重新拷贝
+                task->add_produce_record(dst_topic, partition, std::move(*rec));
+                ++cnt;
+            }
+        }
+
+        moved = true;
+        co_await KafkaAwaiter(task);
+
+        int state = task->get_state();
+        int error = task->get_error();
+        task = nullptr;
+
+        if (state == WFT_STATE_SUCCESS) {
+            done = true;
+            break;
+        }
+
+        wait = dst_policy.on_failure(state, error);
+
+        auto str = std::format("Produce Failed state:{} error:{} retry after {}ms",
+                               state, error, wait.count());
+        std::cout << str << std::endl;
+
+        co_await tk.wait_stop_for(wait);
+    }
+
+    if (!done) {
+        if (commit_task)
+            commit_task->dismiss();
+
+        ok = false;
+        co_return;
+    }
+
+    dst_policy.on_success();
+
+    std::cout << std::format("Mirror Success records:{}", cnt) << std::endl;
+
+    if (!commit_task)
+        co_return;
+
+    co_await KafkaAwaiter(commit_task);
+
+    int state = commit_task->get_state();
+    int error = commit_task->get_error();
+    if (state == WFT_STATE_SUCCESS)
+        std::cout << "Commit Success" << std::endl;
+    else {
+        // 未提交的offset会在下一批次提交时一并覆盖
+        std::cout << "Commit Failed" << std::endl;
+        src_policy.on_failure(state, error);
+    }
+}
+
+coke::Task<> mirror(WFKafkaClient &src, WFKafkaClient &refetch, WFKafkaClient &dst,
+                    coke::StopToken &tk, RetryPolicy &src_policy, RetryPolicy &dst_policy)
+{
+    coke::StopToken::FinishGuard fg(&tk);
+    MirrorBatch batches[2];
+    int cur = 0;
+    bool ok = true;
+
+    co_await fetch_batch(src, batches[cur], src_policy);
+
+    while (!tk.stop_requested()) {
+        MirrorBatch &batch = batches[cur];
+        MirrorBatch &next = batches[cur ^ 1];
+
+        if (batch.state != WFT_STATE_SUCCESS) {
+            auto str = std::format("Fetch Failed state:{} error:{} retry after {}ms",
+                                   batch.state, batch.error, batch.wait.count());
+            std::cout << str << std::endl;
+
+            co_await tk.wait_stop_for(batch.wait);
+
+            batch.reset();
+            co_await fetch_batch(src, batch, src_policy);
+            continue;
+        }
+
+        // 写入当前批次的同时拉取下一批次，将两端的往返时间重叠起来
+        next.reset();
+        co_await coke::async_wait(
+            mirror_batch(src, refetch, dst, batch, src_policy, dst_policy, tk, ok),
+            fetch_batch(src, next, src_policy)
+        );
+
+        // 只有收到停止信号时才会放弃批次，未提交的offset在重启后继续复制
+        if (!ok)
+            break;
+
+        cur ^= 1;
+    }
+
+    WFKafkaTask *leave_task = src.create_leavegroup_task(retry_max, nullptr);
+    co_await KafkaAwaiter(leave_task);
+
+    int state = leave_task->get_state();
+    if (state == WFT_STATE_SUCCESS)
+        std::cout << "Leave Success" << std::endl;
+    else
+        std::cout << "Leave Failed" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    coke::OptionParser args;
+
+    args.add_string(src_brokers, 's', "source", true)
+        .set_description("The url of source broker(s), like \"kafka://localhost:9092/\".");
+
+    args.add_string(dst_brokers, 'd', "target", true)
+        .set_description("The url of target broker(s), like \"kafka://localhost:9093/\".");
+
+    args.add_string(topic, 't', "topic", true)
+        .set_description("The topic to mirror from.");
+
+    args.add_string(target_topic, 0, "target-topic", false)
+        .set_description("The topic to mirror to, default the same as --topic.");
+
+    args.add_string(group, 'g', "group", true)
+        .set_description("The name of fetch group on source cluster.");
+
+    args.add_string(partition_map_str, 'p', "partition-map", false)
+        .set_description("Map source partition to target partition.")
+        .set_long_descriptions({
+            "Format is \"src:dst,src:dst\", use \"*\" as src to set the default rule,",
+            "dst -1 means choose by partitioner, default keep the same partition."
+        });
+
+    args.add_integer(retry_max, 0, "retry", false)
+        .set_default(0)
+        .set_description("Max retry for each task.");
+
+    args.add_bool(latest, 0, "latest")
+        .set_default(false)
+        .set_description("Use latest offset if no committed offset, default earlist");
+
+    add_thread_options(args, ts);
+    add_metrics_options(args, ms);
+
+    args.set_help_flag('h', "help");
+
+    std::string err;
+    int ret = args.parse(argc, argv, err);
+
+    if (ret < 0) {
+        std::cerr << err << std::endl;
+        return 1;
+    }
+    else if (ret > 0) {
+        args.usage(std::cout);
+        return 0;
+    }
+
+    if (!parse_partition_map(partition_map_str)) {
+        std::cerr << "Invalid partition map " << partition_map_str << std::endl;
+        return 1;
+    }
+
+    apply_thread_settings(ts);
+    signal(SIGINT, sig_handler);
+
+    coke::StopToken tk;
+    // refetch不加入消费组，只用于写入失败后按offset重新拉取批次
+    WFKafkaClient src, refetch, dst;
+    src.init(src_brokers, group);
+    refetch.init(src_brokers);
+    dst.init(dst_brokers);
+
+    RetryPolicy src_policy("source"), dst_policy("target");
+    MetricsReporter reporter(ms);
+    reporter.add(&src_policy);
+    reporter.add(&dst_policy);
+    reporter.start();
+
+    coke::detach(mirror(src, refetch, dst, tk, src_policy, dst_policy));
+
+    running.wait(true);
+    tk.request_stop();
+
+    coke::sync_wait(tk.wait_finish());
+
+    reporter.stop();
+    std::cout << src_policy.metrics() << dst_policy.metrics();
+    dst.deinit();
+    refetch.deinit();
+    src.deinit();
+    return 0;
+}
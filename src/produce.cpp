@@ -1,10 +1,20 @@
+#include <algorithm>
 #include <atomic>
 #include <csignal>
+#include <deque>
+#include <filesystem>
 #include <format>
+#include <memory>
 #include <string>
+#include <vector>
 #include <iostream>
 
+#include "chunking.h"
+#include "global_settings.h"
 #include "kafka_awaiter.h"
+#include "metrics_reporter.h"
+#include "produce_spool.h"
+#include "retry_policy.h"
 #include "show_result.h"
 
 #include "coke/sleep.h"
@@ -18,7 +28,16 @@ std::atomic<bool> running{true};
 
 std::string brokers;
 std::string topic;
+std::string spool_dir;
 int retry_max = 0;
+int spool_max_mb = 1024;
+int spool_segment_mb = 64;
+int spool_batch_kb = 1024;
+int instances = 1;
+int value_size = 0;
+int chunk_size = 0;
+ThreadSettings ts;
+MetricsSettings ms;
 
 void sig_handler(int signo) {
     if (running.load() == false)
@@ -36,18 +55,199 @@ WFKafkaTask *create_produce_task(WFKafkaClient &cli) {
     cfg.set_produce_timeout(1000);
     task->set_config(cfg);
 
+    // 同一条消息的chunk具有相同的key，按key选择partition使它们落在同一个partition中
+    if (chunk_size > 0)
+        task->set_partitioner(chunk_partitioner);
+
     return task;
 }
 
-coke::Task<> produce(WFKafkaClient &cli, coke::StopToken &tk) {
+/**
+ * 将values写入spool，已写入的数据从values中移除。spool已满时剩余的数据保留在values中，
+ * 调用者暂停生成新数据，等待回放释放空间后再次写入，从而不会丢弃任何数据。
+*/
+void spool_values(ProduceSpool &spool, std::vector<std::string> &values) {
+    std::size_t cnt = 0;
+
+    for (const auto &value : values) {
+        if (!spool.append(nullptr, 0, value.data(), value.size()))
+            break;
+        ++cnt;
+    }
+
+    values.erase(values.begin(), values.begin() + cnt);
+
+    if (!values.empty())
+        std::cout << std::format("Spool Full waiting:{}", values.size()) << std::endl;
+
+    spool.sync();
+    std::cout << std::format("Spooled records:{} pending bytes:{}", cnt,
+                             spool.pending_bytes()) << std::endl;
+}
+
+/**
+ * 将spool中积压的数据按大批次回放，每批生产成功后才确认消费位置，失败时保留数据等待
+ * 下一次回放。返回值是回放失败或被熔断时建议的等待时间，全部回放完成时为0。
+*/
+coke::Task<RetryPolicy::duration_type>
+drain_spool(WFKafkaClient &cli, ProduceSpool &spool, coke::StopToken &tk, RetryPolicy &policy) {
+    while (!spool.empty() && !tk.stop_requested()) {
+        auto wait = policy.before_request();
+        if (wait.count() > 0)
+            co_return wait;
+
+        WFKafkaTask *task = create_produce_task(cli);
+        std::size_t cnt = 0;
+
+        auto pos = spool.peek(SIZE_MAX, (std::size_t)spool_batch_kb * 1024,
+            [task, &cnt](const void *key, std::size_t key_len,
+                         const void *value, std::size_t value_len) {
+                // spool中保存的是拆分前的value，回放时同样需要拆分
+                if (key_len == 0 && chunk_size > 0) {
+                    cnt += add_chunked_value(task, topic, value, value_len, chunk_size);
+                    return;
+                }
+
+                KafkaRecord r;
+
+                if (key_len)
+                    r.set_key(key, key_len);
+                r.set_value(value, value_len);
+
+                task->add_produce_record(topic, -1, std::move(r));
+                ++cnt;
+            }
+        );
+
+        co_await KafkaAwaiter(task);
+
+        int state = task->get_state();
+        int error = task->get_error();
+
+        if (state != WFT_STATE_SUCCESS) {
+            auto str = std::format("Replay Failed state:{} error:{}", state, error);
+            std::cout << str << std::endl;
+            co_return policy.on_failure(state, error);
+        }
+
+        policy.on_success();
+        spool.consume(pos);
+        std::cout << std::format("Replay Success records:{}", cnt) << std::endl;
+    }
+
+    co_return RetryPolicy::duration_type(0);
+}
+
+bool has_spooled_data(const std::filesystem::path &dir) {
+    std::error_code ec;
+
+    for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+        if (entry.path().extension() == ".seg")
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * 每个实例的spool总是位于spool_dir/i，与实例数无关，修改--instances后原有的数据仍能被
+ * 对应编号的实例回放。
+*/
+bool prepare_spool_dirs(const std::string &dir, int instances) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+
+    fs::create_directories(dir, ec);
+    if (ec)
+        return false;
+
+    // 实例数减少后，编号较大的目录中未回放的数据将无人处理，拒绝启动而不是遗弃它们
+    for (const auto &entry : fs::directory_iterator(dir, ec)) {
+        int idx;
+
+        try {
+            idx = std::stoi(entry.path().filename().string());
+        }
+        catch (...) {
+            continue;
+        }
+
+        if (idx < instances || !entry.is_directory() || !has_spooled_data(entry.path()))
+            continue;
+
+        std::cerr << entry.path().string() << " still has spooled data, run with "
+                  << "--instances " << idx + 1 << " until it is drained" << std::endl;
+        return false;
+    }
+
+    return !ec;
+}
+
+struct ProduceInstance {
+    WFKafkaClient cli;
+    coke::StopToken tk;
+    std::unique_ptr<ProduceSpool> spool;
+    RetryPolicy policy;
+
+    ProduceInstance(std::string name) : policy(std::move(name)) { }
+};
+
+coke::Task<> produce(WFKafkaClient &cli, coke::StopToken &tk,
+                     ProduceSpool *spool, RetryPolicy &policy)
+{
+    // 保留一份数据，生产失败时可以写入spool；spool已满而未能写入的数据也保留在这里，
+    // 在它们被处理之前不会生成新的数据
+    std::vector<std::string> values;
+
     // 循环执行，直到收到停止信号
     while (!tk.stop_requested()) {
+        // 每次生产后等待一下，限制生产速度；失败时按退避策略延长等待时间
+        RetryPolicy::duration_type delay = std::chrono::seconds(1);
+
+        for (int i = 0; values.empty() && i < 20; i++) {
+            std::string value = "kafka-value-" + std::to_string(i);
+
+            // 用于构造超过broker消息大小限制的数据
+            if ((int)value.size() < value_size)
+                value.resize(value_size, 'v');
+
+            values.push_back(std::move(value));
+        }
+
+        // spool中仍有积压时，新数据也先写入spool以保证顺序，然后尝试整体回放
+        if (spool && !spool->empty()) {
+            spool_values(*spool, values);
+
+            auto wait = co_await drain_spool(cli, *spool, tk, policy);
+            co_await tk.wait_stop_for(std::max(delay, wait));
+            continue;
+        }
+
+        // 熔断器打开期间不向broker发送请求
+        auto wait = policy.before_request();
+        if (wait.count() > 0) {
+            if (spool)
+                spool_values(*spool, values);
+            else {
+                std::cout << std::format("Circuit Open dropped:{}", values.size()) << std::endl;
+                values.clear();
+            }
+
+            co_await tk.wait_stop_for(wait);
+            continue;
+        }
+
         WFKafkaTask *task = create_produce_task(cli);
 
         // 每次生产一批数据
-        for (int i = 0; i < 20; i++) {
+        for (const auto &value : values) {
+            // 开启chunk时，超过chunk_size的value会被拆分为多条带有chunk headers的记录
+            if (chunk_size > 0) {
+                add_chunked_value(task, topic, value.c_str(), value.size(), chunk_size);
+                continue;
+            }
+
             KafkaRecord r;
-            std::string value = "kafka-value-" + std::to_string(i);
 
             r.set_value(value.c_str(), value.size());
 
@@ -68,9 +268,18 @@ coke::Task<> produce(WFKafkaClient &cli, coke::StopToken &tk) {
         if (state != WFT_STATE_SUCCESS) {
             auto str = std::format("Produce Failed state:{} error:{}", state, error);
             std::cout << str << std::endl;
+
+            if (spool)
+                spool_values(*spool, values);
+            else
+                values.clear();
+
+            delay = std::max(delay, policy.on_failure(state, error));
         }
         else {
             std::cout << "Produce Success" << std::endl;
+            policy.on_success();
+            values.clear();
 
             std::vector<std::vector<KafkaRecord *>> vec_records;
             KafkaResult result = std::move(*(task->get_result()));
@@ -79,12 +288,14 @@ coke::Task<> produce(WFKafkaClient &cli, coke::StopToken &tk) {
             show_kafka_result(vec_records);
         }
 
-        // 每次生产后等待一下，限制生产速度
-        co_await tk.wait_stop_for(std::chrono::seconds(1));
+        co_await tk.wait_stop_for(delay);
 
         // task->get_xxx() // 不好！task已然不存在了
     }
 
+    if (!values.empty())
+        std::cout << std::format("Stopped with unspooled records:{}", values.size()) << std::endl;
+
     // 发出任务完成的通知
     tk.set_finished();
 }
@@ -102,6 +313,36 @@ int main(int argc, char *argv[]) {
         .set_default(0)
         .set_description("Max retry for each task.");
 
+    args.add_string(spool_dir, 0, "spool-dir", false)
+        .set_description("Spool records to this directory when produce failed.");
+
+    args.add_integer(spool_max_mb, 0, "spool-max-mb", false)
+        .set_default(1024)
+        .set_description("Max disk usage of spool in MB.");
+
+    args.add_integer(spool_segment_mb, 0, "spool-segment-mb", false)
+        .set_default(64)
+        .set_description("Size of each spool segment file in MB.");
+
+    args.add_integer(spool_batch_kb, 0, "spool-batch-kb", false)
+        .set_default(1024)
+        .set_description("Max bytes in KB of each replay batch.");
+
+    args.add_integer(instances, 'k', "instances", false)
+        .set_default(1)
+        .set_description("Number of independent clients, each runs its own coroutine.");
+
+    args.add_integer(value_size, 0, "value-size", false)
+        .set_default(0)
+        .set_description("Pad each value to this size in bytes.");
+
+    args.add_integer(chunk_size, 0, "chunk-size", false)
+        .set_default(0)
+        .set_description("Split values larger than this many bytes into chunks, 0 to disable.");
+
+    add_thread_options(args, ts);
+    add_metrics_options(args, ms);
+
     args.set_help_flag('h', "help");
 
     std::string err;
@@ -116,22 +357,88 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    if (value_size < 0 || chunk_size < 0) {
+        std::cerr << "Invalid value or chunk size" << std::endl;
+        return 1;
+    }
+
+    if (instances <= 0) {
+        std::cerr << "Invalid instances " << instances << std::endl;
+        return 1;
+    }
+
+    if (!spool_dir.empty() &&
+        (spool_max_mb <= 0 || spool_segment_mb <= 0 || spool_batch_kb <= 0))
+    {
+        std::cerr << "Invalid spool size" << std::endl;
+        return 1;
+    }
+
+    // spool至少需要两个段，一个回放的同时另一个可以继续写入
+    if (!spool_dir.empty() && spool_max_mb < 2 * spool_segment_mb) {
+        std::cerr << "--spool-max-mb must be at least twice --spool-segment-mb" << std::endl;
+        return 1;
+    }
+
+    // 单条value必须能放入一个段，否则spool满时会一直等待
+    if (!spool_dir.empty() && (std::size_t)value_size + 64 > (std::size_t)spool_segment_mb << 20) {
+        std::cerr << "--value-size is too large for --spool-segment-mb" << std::endl;
+        return 1;
+    }
+
+    apply_thread_settings(ts);
+
+    // 每个实例拥有独立的客户端、spool和重试策略，彼此之间没有共享状态，
+    // 各自的协程由handler线程并行驱动
+    if (!spool_dir.empty() && !prepare_spool_dirs(spool_dir, instances))
+        return 1;
+
+    std::deque<ProduceInstance> insts;
+    for (int i = 0; i < instances; i++) {
+        ProduceInstance &inst = insts.emplace_back(std::format("produce-{}", i));
+
+        if (!spool_dir.empty()) {
+            std::string dir = std::format("{}/{}", spool_dir, i);
+
+            std::size_t segment_size = (std::size_t)spool_segment_mb * 1024 * 1024;
+            std::size_t max_bytes = (std::size_t)spool_max_mb * 1024 * 1024;
+
+            inst.spool = std::make_unique<ProduceSpool>();
+            if (!inst.spool->open(dir, segment_size, max_bytes)) {
+                std::cerr << "Open spool " << dir << " failed" << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    MetricsReporter reporter(ms);
+    for (ProduceInstance &inst : insts)
+        reporter.add(&inst.policy);
+
+    reporter.start();
     signal(SIGINT, sig_handler);
 
-    coke::StopToken tk;
-    WFKafkaClient cli;
-    cli.init(brokers);
+    for (ProduceInstance &inst : insts) {
+        inst.cli.init(brokers);
 
-    // 启动并分离produce协程
-    coke::detach(produce(cli, tk));
+        // 启动并分离produce协程
+        coke::detach(produce(inst.cli, inst.tk, inst.spool.get(), inst.policy));
+    }
 
     // 等待并发送停止信号
     running.wait(true);
-    tk.request_stop();
+    for (ProduceInstance &inst : insts)
+        inst.tk.request_stop();
 
     // 等待后台协程完成，相当于join操作
-    coke::sync_wait(tk.wait_finish());
+    for (ProduceInstance &inst : insts) {
+        coke::sync_wait(inst.tk.wait_finish());
+
+        std::cout << inst.policy.metrics();
+        inst.cli.deinit();
+    }
+
+    reporter.stop();
 
-    cli.deinit();
     return 0;
 }
@@ -1,14 +1,19 @@
+#include <algorithm>
 #include <atomic>
 #include <csignal>
 #include <format>
 #include <string>
 #include <iostream>
 
+#include "global_settings.h"
 #include "kafka_awaiter.h"
+#include "metrics_reporter.h"
+#include "retry_policy.h"
 #include "show_result.h"
 
 #include "coke/sleep.h"
 #include "coke/wait.h"
+#include "coke/stop_token.h"
 #include "coke/tools/option_parser.h"
 
 using namespace protocol;
@@ -18,12 +23,15 @@ std::atomic<bool> running{true};
 std::string brokers;
 std::string topic;
 int retry_max = 0;
+ThreadSettings ts;
+MetricsSettings ms;
 
 void sig_handler(int signo) {
     if (running.load() == false)
         abort();
 
     running.store(false);
+    running.notify_all();
 }
 
 KafkaResultAwaiter produce_message(WFKafkaClient &cli) {
@@ -45,8 +53,20 @@ KafkaResultAwaiter produce_message(WFKafkaClient &cli) {
     return KafkaResultAwaiter(task);
 }
 
-coke::Task<> produce(WFKafkaClient &cli) {
-    while (running.load()) {
+coke::Task<> produce(WFKafkaClient &cli, coke::StopToken &tk, RetryPolicy &policy) {
+    coke::StopToken::FinishGuard fg(&tk);
+
+    while (!tk.stop_requested()) {
+        // 熔断或退避的等待时间可能长达数十秒，使用可被停止信号打断的等待
+        auto wait = policy.before_request();
+        if (wait.count() > 0) {
+            co_await tk.wait_stop_for(wait);
+            continue;
+        }
+
+        // 每次生产后等待一下，失败时按退避策略延长等待时间
+        RetryPolicy::duration_type delay = std::chrono::seconds(1);
+
         // 使用返回结果的等待器，可以避免task生命周期带来的问题，但会带来额外的拷贝或移动
         // 开销，对于结果中未包含的内容(例如task->get_kafka_error())，则无法获取到
         KafkaWaitResult res = co_await produce_message(cli);
@@ -57,9 +77,12 @@ coke::Task<> produce(WFKafkaClient &cli) {
         if (state != WFT_STATE_SUCCESS) {
             auto str = std::format("Produce Failed state:{} error:{}", state, error);
             std::cout << str << std::endl;
+
+            delay = std::max(delay, policy.on_failure(state, error));
         }
         else {
             std::cout << "Produce Success" << std::endl;
+            policy.on_success();
 
             std::vector<std::vector<KafkaRecord *>> vec_records;
             res.result.fetch_records(vec_records);
@@ -67,7 +90,7 @@ coke::Task<> produce(WFKafkaClient &cli) {
             show_kafka_result(vec_records);
         }
 
-        co_await coke::sleep(1.0);
+        co_await tk.wait_stop_for(delay);
     }
 }
 
@@ -84,6 +107,9 @@ int main(int argc, char *argv[]) {
         .set_default(0)
         .set_description("Max retry for each task.");
 
+    add_thread_options(args, ts);
+    add_metrics_options(args, ms);
+
     args.set_help_flag('h', "help");
 
     std::string err;
@@ -98,14 +124,27 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    apply_thread_settings(ts);
     signal(SIGINT, sig_handler);
 
     WFKafkaClient cli;
     cli.init(brokers);
 
-    // 可以简单地同步等待，当收到停止信号后，协程可能因正在sleep而延迟退出
-    coke::sync_wait(produce(cli));
+    RetryPolicy policy("produce");
+    MetricsReporter reporter(ms);
+    reporter.add(&policy);
+    reporter.start();
+
+    // 启动并分离produce协程，收到停止信号后打断其中的等待
+    coke::StopToken tk;
+    coke::detach(produce(cli, tk, policy));
+
+    running.wait(true);
+    tk.request_stop();
+    coke::sync_wait(tk.wait_finish());
 
+    reporter.stop();
+    std::cout << policy.metrics();
     cli.deinit();
     return 0;
 }
@@ -0,0 +1,290 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <format>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "global_settings.h"
+#include "kafka_awaiter.h"
+#include "retry_policy.h"
+
+#include "coke/sleep.h"
+#include "coke/wait.h"
+#include "coke/tools/option_parser.h"
+
+using namespace protocol;
+using bench_clock = std::chrono::steady_clock;
+
+std::string brokers;
+std::string topic;
+std::string cores_str = "1,2,4,8,16";
+int duration = 10;
+int batch_size = 100;
+int record_size = 100;
+int concurrency = 4;
+int retry_max = 0;
+
+struct BenchResult {
+    long long records;
+    long long failed;
+    double seconds;
+};
+
+struct BenchCounter {
+    std::atomic<long long> records{0};
+    std::atomic<long long> failed{0};
+};
+
+WFKafkaTask *create_produce_task(WFKafkaClient &cli) {
+    std::string query("api=produce");
+    auto *task = cli.create_kafka_task(query, retry_max, nullptr);
+
+    KafkaConfig cfg;
+    cfg.set_produce_timeout(1000);
+    task->set_config(cfg);
+
+    return task;
+}
+
+// 等待一段时间，但不会越过deadline
+coke::Task<> wait_until_deadline(RetryPolicy::duration_type wait,
+                                 bench_clock::time_point deadline)
+{
+    std::chrono::duration<double> sec = std::min<bench_clock::duration>(
+        wait, deadline - bench_clock::now());
+
+    if (sec.count() > 0)
+        co_await coke::sleep(sec.count());
+}
+
+coke::Task<> bench_worker(WFKafkaClient &cli, RetryPolicy &policy,
+                          bench_clock::time_point deadline, BenchCounter &cnt)
+{
+    std::string value(record_size, 'x');
+
+    while (bench_clock::now() < deadline) {
+        // 熔断器打开期间不向broker发送请求
+        auto wait = policy.before_request();
+        if (wait.count() > 0) {
+            co_await wait_until_deadline(wait, deadline);
+            continue;
+        }
+
+        WFKafkaTask *task = create_produce_task(cli);
+
+        for (int i = 0; i < batch_size; i++) {
+            KafkaRecord r;
+            r.set_value(value.data(), value.size());
+            task->add_produce_record(topic, -1, std::move(r));
+        }
+
+        co_await KafkaAwaiter(task);
+
+        int state = task->get_state();
+        int error = task->get_error();
+
+        if (state == WFT_STATE_SUCCESS) {
+            policy.on_success();
+            cnt.records.fetch_add(batch_size, std::memory_order_relaxed);
+        }
+        else {
+            cnt.failed.fetch_add(1, std::memory_order_relaxed);
+            co_await wait_until_deadline(policy.on_failure(state, error), deadline);
+        }
+    }
+}
+
+/**
+ * 在子进程中运行，workflow的线程数只能在进程内设置一次，因此每个核数单独fork一个进程。
+ * 进程被绑定到前k个cpu上，poller、handler和compute线程数均设为k，并创建k个互相独立
+ * 的客户端，每个客户端有自己的RetryPolicy，其上运行concurrency个生产协程。
+*/
+BenchResult run_level(int k) {
+    cpu_set_t set;
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    CPU_ZERO(&set);
+    for (int i = 0; i < k; i++)
+        CPU_SET(i % ncpu, &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        std::cerr << "Set affinity failed, continue without binding" << std::endl;
+
+    apply_thread_settings(ThreadSettings{k, k, k});
+
+    std::deque<WFKafkaClient> clis(k);
+    std::deque<RetryPolicy> policies;
+
+    for (int i = 0; i < k; i++) {
+        clis[i].init(brokers);
+        policies.emplace_back(std::format("bench-{}", i));
+    }
+
+    BenchCounter cnt;
+    std::vector<coke::Task<>> tasks;
+    auto start = bench_clock::now();
+    auto deadline = start + std::chrono::seconds(duration);
+
+    for (int i = 0; i < k; i++) {
+        for (int j = 0; j < concurrency; j++)
+            tasks.emplace_back(bench_worker(clis[i], policies[i], deadline, cnt));
+    }
+
+    coke::sync_wait(std::move(tasks));
+
+    std::chrono::duration<double> cost = bench_clock::now() - start;
+
+    for (WFKafkaClient &cli : clis)
+        cli.deinit();
+
+    return BenchResult{cnt.records.load(), cnt.failed.load(), cost.count()};
+}
+
+bool parse_cores(const std::string &str, std::vector<int> &cores) {
+    std::size_t pos = 0;
+
+    while (pos < str.size()) {
+        std::size_t end = str.find(',', pos);
+        if (end == std::string::npos)
+            end = str.size();
+
+        try {
+            int k = std::stoi(str.substr(pos, end - pos));
+            if (k <= 0)
+                return false;
+
+            cores.push_back(k);
+        }
+        catch (...) {
+            return false;
+        }
+
+        pos = end + 1;
+    }
+
+    return !cores.empty();
+}
+
+bool fork_level(int k, BenchResult &res) {
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+
+        BenchResult r = run_level(k);
+        ssize_t n = write(fds[1], &r, sizeof(r));
+
+        close(fds[1]);
+        _exit(n == (ssize_t)sizeof(r) ? 0 : 1);
+    }
+
+    close(fds[1]);
+
+    ssize_t n = read(fds[0], &res, sizeof(res));
+    int status = 0;
+
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+
+    return n == (ssize_t)sizeof(res) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    coke::OptionParser args;
+
+    args.add_string(brokers, 'b', "broker", true)
+        .set_description("The url of broker(s), like \"kafka://localhost:9092/\".");
+
+    args.add_string(topic, 't', "topic", true)
+        .set_description("The topic to produce to.");
+
+    args.add_string(cores_str, 'c', "cores", false)
+        .set_default("1,2,4,8,16")
+        .set_description("Comma separated core counts to measure.");
+
+    args.add_integer(duration, 'd', "duration", false)
+        .set_default(10)
+        .set_description("Seconds to run at each core count.");
+
+    args.add_integer(batch_size, 0, "batch", false)
+        .set_default(100)
+        .set_description("Records in each produce task.");
+
+    args.add_integer(record_size, 0, "record-size", false)
+        .set_default(100)
+        .set_description("Bytes of each record value.");
+
+    args.add_integer(concurrency, 0, "concurrency", false)
+        .set_default(4)
+        .set_description("Produce coroutines on each client.");
+
+    args.add_integer(retry_max, 0, "retry", false)
+        .set_default(0)
+        .set_description("Max retry for each task.");
+
+    args.set_help_flag('h', "help");
+
+    std::string err;
+    int ret = args.parse(argc, argv, err);
+
+    if (ret < 0) {
+        std::cerr << err << std::endl;
+        return 1;
+    }
+    else if (ret > 0) {
+        args.usage(std::cout);
+        return 0;
+    }
+
+    std::vector<int> cores;
+    if (!parse_cores(cores_str, cores)) {
+        std::cerr << "Invalid cores " << cores_str << std::endl;
+        return 1;
+    }
+
+    if (duration <= 0 || batch_size <= 0 || record_size < 0 || concurrency <= 0) {
+        std::cerr << "Invalid arguments" << std::endl;
+        return 1;
+    }
+
+    std::cout << std::format("{:>6} {:>14} {:>10} {:>8} {:>10} {:>8}\n",
+                             "cores", "records/s", "MB/s", "speedup", "efficiency", "failed");
+
+    double base = 0;
+    for (int k : cores) {
+        BenchResult res;
+
+        if (!fork_level(k, res)) {
+            std::cerr << "Run with " << k << " cores failed" << std::endl;
+            continue;
+        }
+
+        double rps = res.records / res.seconds;
+        double mbps = rps * record_size / (1024.0 * 1024.0);
+
+        if (base == 0)
+            base = rps / k;
+
+        double speedup = base > 0 ? rps / base : 0;
+        std::cout << std::format("{:>6} {:>14.0f} {:>10.2f} {:>8.2f} {:>9.1f}% {:>8}\n",
+                                 k, rps, mbps, speedup, speedup * 100.0 / k, res.failed);
+    }
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include <chrono>
+#include <format>
+#include <string>
+#include <iostream>
+
+#include "record_store.h"
+
+#include "coke/tools/option_parser.h"
+
+std::string store_dir;
+std::string topic;
+int partition = 0;
+long long offset = -1;
+long long timestamp = -1;
+long long count = -1;
+bool quiet = false;
+
+int main(int argc, char *argv[]) {
+    coke::OptionParser args;
+
+    args.add_string(store_dir, 'd', "store-dir", true)
+        .set_description("The directory written by --store-dir of fetch examples.");
+
+    args.add_string(topic, 't', "topic", true)
+        .set_description("The topic to replay.");
+
+    args.add_integer(partition, 'p', "partition", true)
+        .set_description("The partition to replay.");
+
+    args.add_integer(offset, 'o', "offset", false)
+        .set_description("Start from the first record whose offset >= this value.");
+
+    args.add_integer(timestamp, 'm', "timestamp", false)
+        .set_description("Start from the first record at or after this timestamp.")
+        .set_long_descriptions({
+            "Start from the first record whose timestamp >= this value,",
+            "if a valid value is set, the --offset option is ignored."
+        });
+
+    args.add_integer(count, 'n', "count", false)
+        .set_description("Max number of records to replay, default all.");
+
+    args.add_flag(quiet, 'q', "quiet")
+        .set_description("Only show the summary, useful to measure replay speed.");
+
+    args.set_help_flag('h', "help");
+
+    std::string err;
+    int ret = args.parse(argc, argv, err);
+
+    if (ret < 0) {
+        std::cerr << err << std::endl;
+        return 1;
+    }
+    else if (ret > 0) {
+        args.usage(std::cout);
+        return 0;
+    }
+
+    RecordStoreReader reader;
+    if (!reader.open(store_dir, topic, partition)) {
+        std::cerr << "No data for " << topic << '-' << partition << std::endl;
+        return 1;
+    }
+
+    bool found = true;
+    if (timestamp >= 0)
+        found = reader.seek_time(timestamp);
+    else if (offset >= 0)
+        found = reader.seek_offset(offset);
+
+    if (!found) {
+        std::cerr << "No record after the given position" << std::endl;
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    StoredRecord rec;
+    long long n = 0, bytes = 0;
+
+    while ((count < 0 || n < count) && reader.next(rec)) {
+        if (!quiet) {
+            auto str = std::format("topic:{} partition:{} offset:{} timestamp:{} vlen:{}\n",
+                                   topic, partition, rec.offset, rec.timestamp, rec.value_len);
+            std::cout << str;
+        }
+
+        bytes += rec.key_len + rec.value_len;
+        ++n;
+    }
+
+    std::chrono::duration<double> cost = std::chrono::steady_clock::now() - start;
+    std::cout << std::format("Replay records:{} bytes:{} cost:{:.3f}s", n, bytes, cost.count())
+              << std::endl;
+
+    return 0;
+}